@@ -0,0 +1,1028 @@
+
+// Copyright CommitThis 2020.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+
+#include "property_free_scheduler.hpp"
+#include "thread_locked_aggregate.hpp"
+#include "thread_locked_cache.hpp"
+#include "thread_locked_kv.hpp"
+#include "thread_locked_metrics.hpp"
+#include "thread_locked_pipeline.hpp"
+#include "thread_locked_scheduler.hpp"
+
+#include <boost/fiber/all.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+
+using namespace std::chrono_literals;
+
+using boost::fibers::algo::shared_work;
+
+
+/*  The schedulers keep their pools in statics, so a pool can only be set up
+    once per process. Each benchmark therefore runs in a child process of its
+    own. */
+
+
+/*  Counts down as fibers finish; waiting blocks the calling fiber rather
+    than the thread. */
+class fiber_latch
+{
+public:
+    explicit fiber_latch(std::size_t count)
+        : m_count{count}
+    {}
+
+    /*  Notifies with the lock held; the waiter may destroy the latch as soon
+        as it sees the count reach zero. */
+    auto count_down() -> void
+    {
+        auto lk = utility::make_unique_lock(m_mutex);
+        if (0 == --m_count) {
+            m_condition.notify_all();
+        }
+    }
+
+    auto wait() -> void
+    {
+        auto lk = utility::make_unique_lock(m_mutex);
+        m_condition.wait(lk, [this](){ return 0 == m_count; });
+    }
+
+private:
+    std::mutex                              m_mutex{};
+    boost::fibers::condition_variable_any   m_condition{};
+    std::size_t                             m_count;
+};
+
+
+
+/*  Installs a scheduler on the main thread and `n_workers` others, then
+    runs `body` on the main fiber. The workers keep scheduling until `body`
+    returns. `Install` is called with `true` on the main thread. */
+template <typename Install, typename Body>
+auto run_pool(std::size_t n_workers, Install install, Body body) -> void
+{
+    auto done = fiber_latch{1};
+    auto workers = std::vector<std::thread>{};
+
+    for (auto ii = 0ull; ii != n_workers; ++ii) {
+        workers.emplace_back([&install, &done](){
+            install(false);
+            done.wait();
+        });
+    }
+
+    install(true);
+    body();
+    done.count_down();
+
+    for (auto && worker : workers) {
+        worker.join();
+    }
+}
+
+
+template <typename Algorithm>
+auto locked_install(std::size_t n_workers)
+{
+    return [n_workers](bool is_main){
+        boost::fibers::use_scheduling_algorithm<Algorithm>(n_workers + 1, is_main);
+    };
+}
+
+
+auto shared_install()
+{
+    return [](bool is_main){
+        boost::fibers::use_scheduling_algorithm<shared_work>(!is_main);
+    };
+}
+
+
+template <typename Fn>
+auto time_it(Fn && fn) -> std::chrono::nanoseconds
+{
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    return std::chrono::steady_clock::now() - start;
+}
+
+
+auto report(std::string const& name, std::string const& scheduler,
+        std::chrono::nanoseconds elapsed, std::size_t operations) -> void
+{
+    utility::locked_print(std::left, std::setw(12), name, std::setw(28),
+            scheduler, std::right, std::setw(10), std::fixed,
+            std::setprecision(1),
+            static_cast<double>(elapsed.count()) / operations, " ns/op\n");
+}
+
+
+/*  Runs `fn` in a child process and waits for it */
+template <typename Fn>
+auto isolated(Fn && fn) -> void
+{
+    std::cout.flush();
+    auto pid = ::fork();
+    if (0 == pid) {
+        fn();
+        std::cout.flush();
+        std::_Exit(EXIT_SUCCESS);
+    }
+    auto status = 0;
+    ::waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || EXIT_SUCCESS != WEXITSTATUS(status)) {
+        utility::locked_print("benchmark child process failed\n");
+    }
+}
+
+
+
+/*  Spawning: every fiber is created, placed, run once and destroyed. This
+    is where the cost of allocating the properties shows. */
+template <typename Install>
+auto spawn_benchmark(std::string const& scheduler, Install install,
+        std::size_t n_workers) -> void
+{
+    constexpr auto fibers = std::size_t{200'000};
+    run_pool(n_workers, install, [&scheduler](){
+        auto latch = fiber_latch{fibers};
+        auto elapsed = time_it([&latch](){
+            for (auto ii = 0ull; ii != fibers; ++ii) {
+                boost::fibers::fiber([&latch](){ latch.count_down(); }).detach();
+            }
+            latch.wait();
+        });
+        report("spawn", scheduler, elapsed, fibers);
+    });
+}
+
+
+/*  Awakening: a fixed set of fibers yield repeatedly, so each operation is
+    one `awakened` followed by one `pick_next`. */
+template <typename Install>
+auto yield_benchmark(std::string const& scheduler, Install install,
+        std::size_t n_workers) -> void
+{
+    constexpr auto fibers = std::size_t{1'000};
+    constexpr auto yields = std::size_t{1'000};
+    run_pool(n_workers, install, [&scheduler](){
+        auto latch = fiber_latch{fibers};
+        auto elapsed = time_it([&latch](){
+            for (auto ii = 0ull; ii != fibers; ++ii) {
+                boost::fibers::fiber([&latch](){
+                    for (auto jj = 0ull; jj != yields; ++jj) {
+                        boost::this_fiber::yield();
+                    }
+                    latch.count_down();
+                }).detach();
+            }
+            latch.wait();
+        });
+        report("yield", scheduler, elapsed, fibers * yields);
+    });
+}
+
+
+/*  Yielding with `lifo_slot`: a few fibers on one worker yield in turn. A
+    yield goes to the back of the queue, not into the slot, so each fiber
+    should run once between every two runs of another; any that come round
+    out of turn are counted. */
+auto lifo_yield_benchmark() -> void
+{
+    constexpr auto fibers = std::size_t{3};
+    constexpr auto yields = std::size_t{100'000};
+    using lifo_scheduler = basic_thread_locked_scheduler<
+            local_round_robin_placement, lifo_slot<>>;
+
+    run_pool(1, locked_install<lifo_scheduler>(1), [](){
+        auto latch = fiber_latch{fibers};
+        /*  Only touched on the worker */
+        auto last = fibers;
+        auto out_of_turn = std::size_t{0};
+        auto elapsed = time_it([&](){
+            for (auto ii = 0ull; ii != fibers; ++ii) {
+                boost::fibers::fiber([&, ii](){
+                    for (auto jj = 0ull; jj != yields; ++jj) {
+                        if (last != fibers && ii != (last + 1) % fibers) {
+                            ++out_of_turn;
+                        }
+                        last = ii;
+                        boost::this_fiber::yield();
+                    }
+                    latch.count_down();
+                }).detach();
+            }
+            latch.wait();
+        });
+        report("yield", "lifo_slot", elapsed, fibers * yields);
+        if (0 != out_of_turn) {
+            utility::locked_print("lifo_slot: ", out_of_turn,
+                    " yields jumped the queue\n");
+        }
+    });
+}
+
+
+
+/*  Priorities: fibers launched with priorities 0 to 3, in that order, onto
+    a worker that is busy, should first run highest first; then, yielding,
+    the highest should get the most turns without any lane going without. */
+auto priority_benchmark() -> void
+{
+    constexpr auto lanes = std::size_t{4};
+    constexpr auto turns = std::size_t{100'000};
+    using prioritised_scheduler = basic_thread_locked_scheduler<
+            local_round_robin_placement, priority_lanes<lanes>>;
+
+    run_pool(1, locked_install<prioritised_scheduler>(1), [](){
+        auto latch = fiber_latch{lanes + 1};
+        auto launched = std::atomic<bool>{false};
+        /*  Only touched on the worker */
+        auto order = std::vector<std::size_t>{};
+        auto runs = std::array<std::size_t, lanes>{};
+        auto total = std::size_t{0};
+
+        auto elapsed = time_it([&](){
+            prioritised_scheduler::spawn([&](){
+                while (!launched.load(std::memory_order_acquire)) {}
+                latch.count_down();
+            }).detach();
+            for (auto lane = std::size_t{0}; lane != lanes; ++lane) {
+                auto options = spawn_options{};
+                options.priority = static_cast<int>(lane);
+                prioritised_scheduler::spawn(options, [&, lane](){
+                    order.push_back(lane);
+                    while (total != turns) {
+                        ++runs[lane];
+                        ++total;
+                        boost::this_fiber::yield();
+                    }
+                    latch.count_down();
+                }).detach();
+            }
+            launched.store(true, std::memory_order_release);
+            latch.wait();
+        });
+        report("priority", "priority_lanes", elapsed, turns);
+
+        if (order != std::vector<std::size_t>{3, 2, 1, 0}) {
+            utility::locked_print("priority_lanes: fibers did not start "
+                    "highest priority first\n");
+        }
+        if (std::max_element(runs.begin(), runs.end()) != &runs[lanes - 1] ||
+                std::find(runs.begin(), runs.end(), 0) != runs.end()) {
+            utility::locked_print("priority_lanes: turns by lane were ",
+                    runs[0], " ", runs[1], " ", runs[2], " ", runs[3], "\n");
+        }
+    });
+}
+
+
+
+/*  Deadlines: fibers launched onto a busy worker with deadlines in no
+    particular order should run earliest deadline first. Those whose
+    deadline has already gone count as a miss each, however often they run
+    late afterwards. */
+auto deadline_benchmark() -> void
+{
+    using namespace std::chrono;
+    constexpr auto yields = std::size_t{1'000};
+    using deadline_scheduler = basic_thread_locked_scheduler<
+            local_round_robin_placement, deadline_queue<>>;
+    /*  In milliseconds from the start; the negative ones have already
+        passed, and the others are put a minute out so that none of them
+        passes while the fibers run */
+    auto const offsets = std::vector<int>{40, -20, 10, 30, -10, 20};
+
+    run_pool(1, locked_install<deadline_scheduler>(1), [&offsets](){
+        auto latch = fiber_latch{offsets.size() + 1};
+        auto launched = std::atomic<bool>{false};
+        /*  Only touched on the worker */
+        auto order = std::vector<int>{};
+        auto worker = std::size_t{0};
+
+        auto start = steady_clock::now();
+        auto elapsed = time_it([&](){
+            deadline_scheduler::spawn([&](){
+                worker = deadline_scheduler::current_index();
+                while (!launched.load(std::memory_order_acquire)) {}
+                latch.count_down();
+            }).detach();
+            for (auto offset : offsets) {
+                auto options = spawn_options{};
+                options.deadline = start + milliseconds{offset} +
+                        (offset > 0 ? minutes{1} : minutes{0});
+                deadline_scheduler::spawn(options, [&, offset](){
+                    order.push_back(offset);
+                    for (auto ii = 0ull; ii != yields; ++ii) {
+                        boost::this_fiber::yield();
+                    }
+                    latch.count_down();
+                }).detach();
+            }
+            launched.store(true, std::memory_order_release);
+            latch.wait();
+        });
+        report("deadline", "deadline_queue", elapsed,
+                offsets.size() * yields);
+
+        auto expected = offsets;
+        std::sort(expected.begin(), expected.end());
+        if (order != expected) {
+            utility::locked_print("deadline_queue: fibers did not start "
+                    "earliest deadline first\n");
+        }
+        auto misses = deadline_scheduler::schedulers()[worker]->queue()
+                .deadline_misses();
+        if (2 != misses) {
+            utility::locked_print("deadline_queue: counted ", misses,
+                    " misses rather than 2\n");
+        }
+    });
+}
+
+
+
+/*  Fair sharing: two groups of equal weight share a worker, one whose
+    fiber runs for a millisecond between yields, the other for 20us. By
+    time actually spent running, each should get about half. */
+auto fair_share_benchmark() -> void
+{
+    using namespace std::chrono;
+    constexpr auto run_for = milliseconds{300};
+    using fair_scheduler = basic_thread_locked_scheduler<
+            local_round_robin_placement, weighted_fair_queue<>>;
+
+    run_pool(1, locked_install<fair_scheduler>(1), [run_for](){
+        auto latch = fiber_latch{2};
+        /*  Only touched on the worker */
+        auto worker = std::size_t{0};
+        auto switches = std::size_t{0};
+
+        auto elapsed = time_it([&](){
+            auto until = steady_clock::now() + run_for;
+            for (auto group : {std::size_t{1}, std::size_t{2}}) {
+                auto options = spawn_options{};
+                options.group = group;
+                auto spin = 1 == group ? microseconds{1'000} : microseconds{20};
+                fair_scheduler::spawn(options, [&, spin, until](){
+                    worker = fair_scheduler::current_index();
+                    while (steady_clock::now() < until) {
+                        auto stop = steady_clock::now() + spin;
+                        while (steady_clock::now() < stop) {}
+                        ++switches;
+                        boost::this_fiber::yield();
+                    }
+                    latch.count_down();
+                }).detach();
+            }
+            latch.wait();
+        });
+        report("fair", "weighted_fair_queue", elapsed, switches);
+
+        auto const& queue = fair_scheduler::schedulers()[worker]->queue();
+        auto long_runs = duration_cast<milliseconds>(queue.run_time(1));
+        auto short_runs = duration_cast<milliseconds>(queue.run_time(2));
+        auto ratio = static_cast<double>(long_runs.count()) /
+                (std::max)(short_runs.count(), milliseconds::rep{1});
+        if (ratio < 0.75 || ratio > 1.33) {
+            utility::locked_print("weighted_fair_queue: equal groups ran for ",
+                    long_runs.count(), "ms and ", short_runs.count(), "ms\n");
+        }
+    });
+}
+
+
+
+/*  Yielding to a given fiber: fibers on one worker each hand over to the
+    fiber three on from them, which is not the order the queue would pick
+    them in. Every handover should run its target next. */
+auto yield_to_benchmark() -> void
+{
+    constexpr auto fibers = std::size_t{8};
+    constexpr auto rounds = std::size_t{10'000};
+    constexpr auto none = fibers;
+
+    run_pool(1, locked_install<thread_locked_scheduler>(1), [](){
+        auto latch = fiber_latch{fibers};
+        auto launched = std::atomic<bool>{false};
+        auto ids = std::vector<boost::fibers::fiber::id>(fibers);
+        /*  Only touched on the worker */
+        auto expected = none;
+        auto wrong = std::size_t{0};
+
+        auto elapsed = time_it([&](){
+            for (auto ii = std::size_t{0}; ii != fibers; ++ii) {
+                auto fiber = boost::fibers::fiber([&, ii](){
+                    while (!launched.load(std::memory_order_acquire)) {
+                        boost::this_fiber::yield();
+                    }
+                    for (auto jj = 0ull; jj != rounds; ++jj) {
+                        if (expected != none && expected != ii) {
+                            ++wrong;
+                        }
+                        expected = (ii + 3) % fibers;
+                        this_fiber::yield_to(ids[expected]);
+                    }
+                    expected = none;
+                    latch.count_down();
+                });
+                ids[ii] = fiber.get_id();
+                fiber.detach();
+            }
+            launched.store(true, std::memory_order_release);
+            latch.wait();
+        });
+        report("yield_to", "thread_locked_scheduler", elapsed,
+                fibers * rounds);
+        if (0 != wrong) {
+            utility::locked_print("yield_to: ", wrong,
+                    " handovers ran some other fiber\n");
+        }
+    });
+}
+
+
+
+/*  Time slices: two long computations on one worker, one checking with
+    `budgeted_for` and the other with `maybe_yield`, should take turns about
+    a slice long. The second starts with a stretch of work before its first
+    check, which already counts against its slice. */
+auto time_slice_benchmark() -> void
+{
+    using namespace std::chrono;
+    constexpr auto slice = milliseconds{1};
+    constexpr auto steps = std::size_t{5'000};
+    constexpr auto none = std::size_t{2};
+    auto spin = [](nanoseconds length){
+        auto stop = steady_clock::now() + length;
+        while (steady_clock::now() < stop) {}
+    };
+
+    /*  The first conversion sleeps to calibrate the counter, which would
+        otherwise land in the middle of the first turn */
+    utility::cycle_clock::to_duration(0);
+    thread_locked_scheduler::set_time_slice(slice);
+    run_pool(1, locked_install<thread_locked_scheduler>(1), [slice, &spin](){
+        auto latch = fiber_latch{2};
+        auto launched = std::atomic<bool>{false};
+        /*  Only touched on the worker */
+        auto owner = none;
+        auto turn_start = steady_clock::time_point{};
+        auto turns = std::vector<nanoseconds>{};
+        auto first_check = false;
+        auto step = [&](std::size_t fiber){
+            if (owner != fiber) {
+                auto now = steady_clock::now();
+                if (owner != none) {
+                    turns.push_back(now - turn_start);
+                }
+                owner = fiber;
+                turn_start = now;
+            }
+            spin(10us);
+        };
+        auto wait_for_launch = [&launched](){
+            while (!launched.load(std::memory_order_acquire)) {
+                boost::this_fiber::yield();
+            }
+        };
+
+        auto elapsed = time_it([&](){
+            boost::fibers::fiber([&](){
+                wait_for_launch();
+                this_fiber::budgeted_for(std::size_t{0}, steps,
+                        [&](auto){ step(0); }, 8);
+                latch.count_down();
+            }).detach();
+            boost::fibers::fiber([&, slice](){
+                wait_for_launch();
+                step(1);
+                spin(3 * slice);
+                first_check = this_fiber::maybe_yield();
+                for (auto ii = std::size_t{0}; ii != steps; ++ii) {
+                    step(1);
+                    this_fiber::maybe_yield();
+                }
+                latch.count_down();
+            }).detach();
+            launched.store(true, std::memory_order_release);
+            latch.wait();
+        });
+        report("slice", "thread_locked_scheduler", elapsed, turns.size());
+
+        if (!first_check) {
+            utility::locked_print("maybe_yield: did not count work done "
+                    "before the first check\n");
+        }
+        /*  By the median, as the thread itself can be preempted in the
+            middle of a turn */
+        auto middle = turns.begin() + turns.size() / 2;
+        std::nth_element(turns.begin(), middle, turns.end());
+        if (turns.size() < 40 || *middle < slice * 9 / 10 ||
+                *middle > 2 * slice) {
+            utility::locked_print("maybe_yield: ", turns.size(),
+                    " turns, the median ", duration_cast<microseconds>(
+                            *middle).count(), "us long\n");
+        }
+    });
+}
+
+
+
+/*  Handing off: the main thread places fibers on workers that are busy
+    running fibers of their own. The placing thread writes to each worker's
+    inbox and wakes it while the worker picks from its ready queue, so this
+    is where the two sharing a cache line would show; for the counters
+    themselves, run it under `perf c2c record ./benchmark handoff`. */
+template <typename Install>
+auto handoff_benchmark(std::string const& scheduler, Install install,
+        std::size_t n_workers) -> void
+{
+    constexpr auto fibers = std::size_t{100'000};
+    run_pool(n_workers, install, [&scheduler, n_workers](){
+        auto busy = n_workers * 4;
+        auto stop = std::atomic<bool>{false};
+        auto stopped = fiber_latch{busy};
+        for (auto ii = 0ull; ii != busy; ++ii) {
+            boost::fibers::fiber([&stop, &stopped](){
+                while (!stop.load(std::memory_order_relaxed)) {
+                    boost::this_fiber::yield();
+                }
+                stopped.count_down();
+            }).detach();
+        }
+
+        auto latch = fiber_latch{fibers};
+        auto elapsed = time_it([&latch](){
+            for (auto ii = 0ull; ii != fibers; ++ii) {
+                boost::fibers::fiber([&latch](){ latch.count_down(); }).detach();
+            }
+            latch.wait();
+        });
+        stop = true;
+        stopped.wait();
+        report("handoff", scheduler, elapsed, fibers);
+    });
+}
+
+
+
+/*  Producer/consumer pairs handing a position in a per pair table back and
+    forth over a channel, each taking a few hundred dependent steps through the
+    table on the way. The pool has a single worker, so every pair shares its
+    ready queue; with plain FIFO ordering the consumer waits behind every other
+    pair, and by the time it runs the table has been pushed out of cache. The
+    random walk stops the prefetcher from hiding that. */
+template <typename Install>
+auto pingpong_benchmark(std::string const& scheduler, Install install) -> void
+{
+    constexpr auto pairs = std::size_t{256};
+    constexpr auto messages = std::size_t{1'000};
+    constexpr auto table_size = std::size_t{4'096};
+    constexpr auto steps = std::size_t{512};
+
+    using table_t = std::vector<std::uint32_t>;
+    using channel_t = boost::fibers::unbuffered_channel<std::uint32_t>;
+
+    /*  Each table is a single cycle through all of its entries */
+    auto tables = std::vector<table_t>(pairs, table_t(table_size));
+    auto random = std::mt19937{42};
+    for (auto & table : tables) {
+        auto order = table_t(table_size);
+        std::iota(order.begin(), order.end(), 0u);
+        std::shuffle(order.begin() + 1, order.end(), random);
+        for (auto ii = 0ull; ii != table_size; ++ii) {
+            table[order[ii]] = order[(ii + 1) % table_size];
+        }
+    }
+
+    auto walk = [](table_t const& table, std::uint32_t position){
+        for (auto ii = 0ull; ii != steps; ++ii) {
+            position = table[position];
+        }
+        return position;
+    };
+
+    run_pool(1, install, [&](){
+        auto channels = std::vector<channel_t>(pairs);
+        auto latch = fiber_latch{pairs * 2};
+        auto checksum = std::atomic<std::uint64_t>{0};
+
+        auto elapsed = time_it([&](){
+            for (auto ii = 0ull; ii != pairs; ++ii) {
+                boost::fibers::fiber([&, ii](){
+                    auto position = std::uint32_t{0};
+                    for (auto jj = 0ull; jj != messages; ++jj) {
+                        position = walk(tables[ii], position);
+                        channels[ii].push(position);
+                    }
+                    channels[ii].close();
+                    latch.count_down();
+                }).detach();
+                boost::fibers::fiber([&, ii](){
+                    auto sum = std::uint64_t{0};
+                    for (auto position : channels[ii]) {
+                        sum += walk(tables[ii], position);
+                    }
+                    checksum += sum;
+                    latch.count_down();
+                }).detach();
+            }
+            latch.wait();
+        });
+        report("pingpong", scheduler, elapsed, pairs * messages);
+    });
+}
+
+
+
+/*  The sharded key-value store: fibers spread over the pool each make a run
+    of lookups and updates on random keys, three gets to every put, either
+    one key at a time or `batch` keys at a time. Almost every key is owned by
+    another shard, so single operations show the cost of a trip to the owner
+    and back, and batches how far that is spread. */
+auto kv_benchmark(std::size_t n_workers, std::size_t batch) -> void
+{
+    constexpr auto clients = std::size_t{64};
+    constexpr auto operations = std::size_t{16'384};
+    constexpr auto keys = std::uint64_t{1} << 20;
+
+    run_pool(n_workers, locked_install<thread_locked_scheduler>(n_workers),
+            [n_workers, batch](){
+        auto store = sharded_kv_store<std::uint64_t, std::uint64_t>{keys};
+        auto latch = fiber_latch{clients};
+        auto elapsed = time_it([&](){
+            for (auto ii = 0ull; ii != clients; ++ii) {
+                thread_locked_scheduler::spawn([&, ii](){
+                    auto random = std::mt19937_64{ii};
+                    auto key_batch = std::vector<std::uint64_t>(batch);
+                    auto item_batch = std::vector<std::pair<std::uint64_t,
+                            std::uint64_t>>(batch);
+                    for (auto jj = 0ull; jj < operations; jj += batch) {
+                        auto put = 0 == (jj / batch) % 4;
+                        if (1 == batch) {
+                            auto key = random() % keys;
+                            put ? static_cast<void>(store.put(key, jj))
+                                : static_cast<void>(store.get(key));
+                        } else if (put) {
+                            for (auto & item : item_batch) {
+                                item = {random() % keys, jj};
+                            }
+                            store.put_many(item_batch);
+                        } else {
+                            for (auto & key : key_batch) {
+                                key = random() % keys;
+                            }
+                            store.get_many(key_batch);
+                        }
+                    }
+                    latch.count_down();
+                }).detach();
+            }
+            latch.wait();
+        });
+        report("kv", "batch of " + std::to_string(batch), elapsed,
+                clients * operations);
+    });
+}
+
+
+
+/*  Caching: clients all over the pool look up keys, skewed towards the low
+    ones, in a `sharded_cache` with room for a quarter of them, loading and
+    caching each one missed. The counters are checked against what the
+    clients did afterwards. */
+auto cache_benchmark(std::size_t n_workers) -> void
+{
+    constexpr auto clients = std::size_t{64};
+    constexpr auto operations = std::size_t{16'384};
+    constexpr auto keys = std::uint64_t{1} << 16;
+    constexpr auto budget = keys / 4 * (2 * sizeof(std::uint64_t));
+
+    run_pool(n_workers, locked_install<thread_locked_scheduler>(n_workers),
+            [](){
+        auto cache = sharded_cache<std::uint64_t, std::uint64_t>{budget};
+        auto latch = fiber_latch{clients};
+        auto wrong = std::atomic<std::size_t>{0};
+        auto elapsed = time_it([&](){
+            for (auto ii = 0ull; ii != clients; ++ii) {
+                thread_locked_scheduler::spawn([&, ii](){
+                    auto random = std::mt19937_64{ii};
+                    for (auto jj = 0ull; jj != operations; ++jj) {
+                        auto key = (random() % keys) * (random() % keys) / keys;
+                        auto value = cache.get_or_load(key,
+                                [](std::uint64_t key){ return key * 3; });
+                        if (value != key * 3) {
+                            wrong.fetch_add(1, std::memory_order_relaxed);
+                        }
+                    }
+                    latch.count_down();
+                }).detach();
+            }
+            latch.wait();
+        });
+        auto totals = cache.totals();
+        report("cache", "hit rate " + std::to_string(
+                100 * totals.hits / (clients * operations)) + "%", elapsed,
+                clients * operations);
+
+        /*  Two fibers missing on the same key both insert it, the second
+            replacing the first, so entries and evictions can fall short of
+            the insertions but never exceed them */
+        if (0 != wrong || totals.hits + totals.misses != clients * operations ||
+                totals.misses < totals.insertions || 0 == totals.evictions ||
+                totals.entries + totals.evictions > totals.insertions ||
+                totals.bytes > budget || 0 != totals.rejections) {
+            utility::locked_print("cache: counters do not add up; ",
+                    wrong.load(), " wrong values, ", totals.hits, " hits, ",
+                    totals.misses, " misses, ", totals.insertions,
+                    " insertions, ", totals.evictions, " evictions, ",
+                    totals.entries, " entries, ", totals.bytes, " bytes\n");
+        }
+    });
+}
+
+
+
+/*  Counting: fibers all over the pool bump one counter, either a single
+    atomic shared by every thread or a `sharded_counter`, whose cells each
+    stay in their own core's cache. */
+template <typename Counter>
+auto counter_benchmark(std::string const& name, std::size_t n_workers) -> void
+{
+    constexpr auto fibers = std::size_t{256};
+    constexpr auto increments = std::size_t{100'000};
+
+    run_pool(n_workers, locked_install<thread_locked_scheduler>(n_workers),
+            [&name](){
+        auto counter = Counter{};
+        auto latch = fiber_latch{fibers};
+        auto elapsed = time_it([&](){
+            for (auto ii = 0ull; ii != fibers; ++ii) {
+                boost::fibers::fiber([&](){
+                    for (auto jj = 0ull; jj != increments; ++jj) {
+                        if constexpr (std::is_same_v<Counter,
+                                std::atomic<std::uint64_t>>) {
+                            counter.fetch_add(1, std::memory_order_relaxed);
+                        } else {
+                            counter.inc();
+                        }
+                    }
+                    latch.count_down();
+                }).detach();
+            }
+            latch.wait();
+        });
+        report("counter", name, elapsed, fibers * increments);
+    });
+}
+
+
+
+/*  Grouping: a sum and count per key over 4M rows in 64 partitions, by
+    `hash_aggregate` across the pool, and by one thread into a
+    `std::unordered_map` for comparison. */
+auto aggregate_benchmark(std::size_t n_workers) -> void
+{
+    constexpr auto partitions = std::size_t{64};
+    constexpr auto rows = std::size_t{65'536};
+    constexpr auto keys = std::uint64_t{100'000};
+
+    struct row
+    {
+        std::uint64_t   key;
+        std::uint64_t   amount;
+    };
+    struct group
+    {
+        std::uint64_t   sum{0};
+        std::uint64_t   count{0};
+    };
+
+    auto input = std::vector<std::vector<row>>(partitions);
+    auto random = std::mt19937_64{42};
+    for (auto & partition : input) {
+        partition.resize(rows);
+        for (auto & each : partition) {
+            each = row{random() % keys, random() % 1'000};
+        }
+    }
+
+    run_pool(n_workers, locked_install<thread_locked_scheduler>(n_workers),
+            [&input, n_workers](){
+        auto groups = std::size_t{0};
+        auto pooled = std::chrono::nanoseconds{};
+        thread_locked_scheduler::spawn([&](){
+            pooled = time_it([&](){
+                auto result = hash_aggregate<std::uint64_t, group>(input,
+                        [](row const& each){ return each.key; },
+                        [](group & into, row const& each){
+                            into.sum += each.amount;
+                            ++into.count;
+                        },
+                        [](group & into, group const& from){
+                            into.sum += from.sum;
+                            into.count += from.count;
+                        });
+                groups = result.size();
+            });
+        }).join();
+        report("aggregate", "hash_aggregate", pooled, partitions * rows);
+
+        auto single = time_it([&](){
+            auto result = std::unordered_map<std::uint64_t, group>{};
+            for (auto const& partition : input) {
+                for (auto const& each : partition) {
+                    auto & into = result[each.key];
+                    into.sum += each.amount;
+                    ++into.count;
+                }
+            }
+            groups -= result.size();
+        });
+        report("aggregate", "std::unordered_map", single, partitions * rows);
+        if (0 != groups) {
+            utility::locked_print("aggregate: group counts differ\n");
+        }
+    });
+}
+
+
+
+/*  A three stage pipeline, moving items one at a time and then in batches
+    of 64. Each stage is pinned to a scheduler of its own, and there are
+    always at least three workers for them, however few cores there are, so
+    that every item crosses two threads. */
+auto pipeline_benchmark(std::size_t n_workers, std::size_t batch) -> void
+{
+    constexpr auto items = std::size_t{1'000'000};
+    constexpr auto stages = std::size_t{3};
+    n_workers = std::max(n_workers, stages);
+
+    run_pool(n_workers, locked_install<thread_locked_scheduler>(n_workers),
+            [batch](){
+        auto elapsed = std::chrono::nanoseconds{};
+        thread_locked_scheduler::spawn([&](){
+            auto options = [&](std::size_t stage){
+                auto chosen = stage_options{};
+                chosen.scheduler = stage;
+                chosen.batch = batch;
+                return chosen;
+            };
+            auto flow = pipeline<>{};
+            auto numbers = flow.source<std::uint64_t>("source", options(0),
+                    [](auto emit){
+                for (auto ii = std::uint64_t{0}; ii != items; ++ii) {
+                    if (!emit(ii)) {
+                        return;
+                    }
+                }
+            });
+            auto squares = flow.stage<std::uint64_t>("square", numbers,
+                    options(1), [](std::uint64_t value, auto emit){
+                emit(value * value);
+            });
+            auto sum = std::uint64_t{0};
+            flow.sink("sum", squares, options(2),
+                    [&sum](std::uint64_t value){ sum += value; });
+            elapsed = time_it([&flow](){ flow.run(); });
+        }).join();
+        report("pipeline", "batch of " + std::to_string(batch), elapsed,
+                items);
+    });
+}
+
+
+
+template <typename Benchmark>
+auto run_schedulers(Benchmark benchmark, std::size_t n_workers) -> void
+{
+    isolated([&](){
+        benchmark("thread_locked_scheduler",
+                locked_install<thread_locked_scheduler>(n_workers), n_workers);
+    });
+    isolated([&](){
+        benchmark("property_free_scheduler",
+                locked_install<property_free_scheduler>(n_workers), n_workers);
+    });
+    isolated([&](){
+        benchmark("shared_work", shared_install(), n_workers);
+    });
+}
+
+
+/*  Usage: benchmark [name...]. Runs every benchmark when none are named. */
+auto main(int argc, char const * argv[]) -> int
+{
+    auto n_workers = static_cast<std::size_t>(
+            std::max(2u, std::thread::hardware_concurrency()) - 1);
+    auto selected = std::vector<std::string>(argv + 1, argv + argc);
+    auto wanted = [&selected](std::string const& name){
+        return selected.empty() ||
+                std::find(selected.begin(), selected.end(), name) != selected.end();
+    };
+
+    utility::locked_print("workers: ", n_workers, "\n");
+
+    if (wanted("spawn")) {
+        run_schedulers([](auto && ... args){ spawn_benchmark(args...); },
+                n_workers);
+    }
+    if (wanted("yield")) {
+        run_schedulers([](auto && ... args){ yield_benchmark(args...); },
+                n_workers);
+        isolated([](){ lifo_yield_benchmark(); });
+    }
+    if (wanted("priority")) {
+        isolated([](){ priority_benchmark(); });
+    }
+    if (wanted("deadline")) {
+        isolated([](){ deadline_benchmark(); });
+    }
+    if (wanted("fair")) {
+        isolated([](){ fair_share_benchmark(); });
+    }
+    if (wanted("yield_to")) {
+        isolated([](){ yield_to_benchmark(); });
+    }
+    if (wanted("slice")) {
+        isolated([](){ time_slice_benchmark(); });
+    }
+    /*  Not run on `shared_work`, which only resumes the pinned main fiber
+        once its shared queue is empty, and the busy fibers never let it be */
+    if (wanted("handoff")) {
+        isolated([n_workers](){
+            handoff_benchmark("thread_locked_scheduler",
+                    locked_install<thread_locked_scheduler>(n_workers),
+                    n_workers);
+        });
+        isolated([n_workers](){
+            handoff_benchmark("property_free_scheduler",
+                    locked_install<property_free_scheduler>(n_workers),
+                    n_workers);
+        });
+    }
+    /*  Only for `thread_locked_scheduler`, which the store is built on */
+    if (wanted("kv")) {
+        for (auto batch : {std::size_t{1}, std::size_t{64}}) {
+            isolated([n_workers, batch](){ kv_benchmark(n_workers, batch); });
+        }
+    }
+    if (wanted("cache")) {
+        isolated([n_workers](){ cache_benchmark(n_workers); });
+    }
+    if (wanted("counter")) {
+        isolated([n_workers](){
+            counter_benchmark<std::atomic<std::uint64_t>>("std::atomic",
+                    n_workers);
+        });
+        isolated([n_workers](){
+            counter_benchmark<sharded_counter<>>("sharded_counter", n_workers);
+        });
+    }
+    if (wanted("aggregate")) {
+        isolated([n_workers](){ aggregate_benchmark(n_workers); });
+    }
+    if (wanted("pipeline")) {
+        for (auto batch : {std::size_t{1}, std::size_t{64}}) {
+            isolated([n_workers, batch](){
+                pipeline_benchmark(n_workers, batch);
+            });
+        }
+    }
+    if (wanted("pingpong")) {
+        isolated([](){
+            pingpong_benchmark("thread_locked_scheduler",
+                    locked_install<thread_locked_scheduler>(1));
+        });
+        isolated([](){
+            using lifo_scheduler = basic_thread_locked_scheduler<
+                    local_round_robin_placement, lifo_slot<>>;
+            pingpong_benchmark("lifo_slot", locked_install<lifo_scheduler>(1));
+        });
+    }
+}
@@ -0,0 +1,213 @@
+
+//      Copyright CommitThis 2020
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "thread_locked_scheduler.hpp"
+
+#include <boost/fiber/algo/algorithm.hpp>
+
+
+
+/*  A thread locked scheduler without fiber properties.
+
+    `thread_locked_scheduler` needs `thread_locked_props` to tell a new fiber
+    from one that has already been placed, which costs an allocation per fiber
+    and a `notify()` when it is first placed. This scheduler tells them apart
+    by where they are awakened instead: the dispatching scheduler (the one
+    constructed with `main_scheduler` set) never keeps a fiber, so any fiber
+    awakened there is new and is placed on a worker. A worker keeps every
+    fiber awakened on it, including those it spawns itself; they are pinned to
+    the worker that spawned them rather than distributed.
+
+    Placed fibers also stay attached to their worker between wake ups, so the
+    detach and attach done by `thread_locked_scheduler` on every wake up is
+    skipped too.
+*/
+template <typename Placement = local_round_robin_placement,
+          typename Queue = fifo_queue,
+          typename Idle = condition_idle,
+          typename Stats = no_stats,
+          std::size_t Workers = dynamic_workers>
+class basic_property_free_scheduler : public boost::fibers::algo::algorithm
+{
+    using scheduler_ptr_t = boost::intrusive_ptr<basic_property_free_scheduler>;
+    using scheduler_list_t = std::conditional_t<Workers == dynamic_workers,
+            std::vector<scheduler_ptr_t>,
+            std::array<scheduler_ptr_t, Workers>>;
+    using inbox_t = boost::fibers::scheduler::ready_queue_type;
+
+public:
+    using placement_type = Placement;
+    using queue_type = Queue;
+    using idle_type = Idle;
+    using stats_type = Stats;
+
+    static constexpr std::size_t worker_count = Workers;
+
+    basic_property_free_scheduler(std::size_t thread_count,
+            bool main_scheduler = false)
+        : m_local_queue{}
+        , m_placement{}
+        , m_stats{}
+        , m_dispatcher{main_scheduler}
+        , m_inbox_mutex{}
+        , m_inbox{}
+        , m_inbox_pending{false}
+        , m_idle{}
+    {
+        static boost::barrier barrier{static_cast<std::uint32_t>(thread_count)};
+
+        if constexpr (Workers == dynamic_workers) {
+            static std::once_flag flag;
+            std::call_once(flag, [thread_count](){
+                scheduler_list_t{thread_count - 1, nullptr}.swap(s_schedulers);
+            });
+        } else {
+            BOOST_ASSERT_MSG(thread_count - 1 == Workers,
+                    "thread count does not match the fixed worker count");
+        }
+
+        if (!main_scheduler) {
+            auto index = s_registered++;
+            BOOST_ASSERT(index < std::size(s_schedulers));
+            s_schedulers[index] = this;
+        }
+
+        barrier.wait();
+    }
+
+
+    /*  Used to accept a context from the dispatching thread, by way of the
+        inbox, as with `thread_locked_scheduler` */
+    auto accept(context * ctx) -> void
+    {
+        {
+            auto lock = std::lock_guard<std::mutex>{ m_inbox_mutex };
+            m_inbox.push_back(*ctx);
+            m_inbox_pending.store(true, std::memory_order_release);
+        }
+        m_stats.on_accepted();
+        m_idle.notify();
+    }
+
+
+    /*  On the dispatcher, every worker fiber is new and is placed elsewhere;
+        on a worker, every fiber stays put. */
+    auto awakened(context * ctx) noexcept -> void
+    {
+        m_stats.on_awakened();
+        if (m_dispatcher &&
+                !ctx->is_context(boost::fibers::type::pinned_context)) {
+            ctx->detach();
+            auto next = s_schedulers[m_placement.next(list_size())].get();
+            m_stats.on_placed();
+            next->accept(ctx);
+        }
+        else {
+            m_local_queue.push(ctx);
+        }
+    }
+
+
+    /*  Only a newly accepted fiber is detached from any scheduler */
+    auto pick_next() noexcept -> context *
+    {
+        drain_inbox();
+        auto ctx = m_local_queue.pop();
+
+        if (nullptr != ctx) {
+            m_stats.on_picked();
+            if (nullptr == ctx->get_scheduler()) {
+                context::active()->attach(ctx);
+            }
+        }
+
+        return ctx;
+    }
+
+
+    auto has_ready_fibers() const noexcept -> bool
+    {
+        return ! m_local_queue.empty() ||
+                m_inbox_pending.load(std::memory_order_acquire);
+    }
+
+
+    auto suspend_until(std::chrono::steady_clock::time_point const& time_point)
+        noexcept -> void
+    {
+        m_stats.on_idle();
+        m_idle.suspend_until(time_point);
+    }
+
+    auto notify() noexcept -> void
+    {
+        m_idle.notify();
+    }
+
+
+    auto stats() const noexcept -> Stats const&
+    {
+        return m_stats;
+    }
+
+    static auto schedulers() noexcept -> scheduler_list_t const&
+    {
+        return s_schedulers;
+    }
+
+private:
+    static auto list_size() noexcept
+    {
+        if constexpr (Workers == dynamic_workers) {
+            return std::size(s_schedulers);
+        } else {
+            return std::integral_constant<std::size_t, Workers>{};
+        }
+    }
+
+    auto drain_inbox() noexcept -> void
+    {
+        if (!m_inbox_pending.load(std::memory_order_acquire)) {
+            return;
+        }
+        auto batch = inbox_t{};
+        {
+            auto lock = std::lock_guard<std::mutex>{ m_inbox_mutex };
+            batch.swap(m_inbox);
+            m_inbox_pending.store(false, std::memory_order_relaxed);
+        }
+        while (!batch.empty()) {
+            auto ctx = &batch.front();
+            batch.pop_front();
+            m_local_queue.push(ctx);
+        }
+    }
+
+    /*  As in `thread_locked_scheduler`, each on a line of its own */
+    alignas(utility::cache_line_size)
+    inline static std::atomic<std::size_t> s_registered{0};
+    alignas(utility::cache_line_size)
+    inline static scheduler_list_t         s_schedulers{};
+
+    /*  Laid out as in `thread_locked_scheduler`; owner only first */
+    alignas(utility::cache_line_size)
+    Queue       m_local_queue;
+    Placement   m_placement;
+    Stats       m_stats;
+    bool        m_dispatcher;
+
+    /*  Written by the dispatching thread */
+    alignas(utility::cache_line_size)
+    std::mutex  m_inbox_mutex;
+    inbox_t     m_inbox;
+    std::atomic<bool> m_inbox_pending;
+    Idle        m_idle;
+};
+
+
+using property_free_scheduler = basic_property_free_scheduler<>;
@@ -0,0 +1,516 @@
+
+// Copyright CommitThis 2020.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+
+#include "property_free_scheduler.hpp"
+#include "thread_locked_dump.hpp"
+#include "thread_locked_profiler.hpp"
+#include "thread_locked_scheduler.hpp"
+#include "thread_locked_watchdog.hpp"
+
+#include <boost/fiber/all.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+
+/*  Stress harness for the pinning guarantee.
+
+    Every round launches a batch of fibers which each take a random walk
+    through the ways a fiber can be suspended and woken again: yielding,
+    sleeping, waiting on a fiber mutex shared with fibers on other threads,
+    and passing tokens through a channel shared by the whole round. Some
+    spawn a child from their worker, which must stay on that worker too.
+    After each step a fiber checks that it is on the thread it started on
+    and sees the same thread local object; any difference is a migration.
+
+    Throughput is reported along the way, so that a change which makes the
+    scheduler faster by breaking the guarantee is caught at the same time.
+    The exit status is non-zero if anything migrated.
+
+    With `thread_locked_scheduler`, the tools for looking into a pool run
+    alongside and get stressed too: the profiler's signals land on workers in
+    the middle of switching fibers, whose names it copies as they change,
+    the watchdog reports any worker held up for more than a second, and
+    `kill -USR1` dumps the state of a round that seems to be stuck.
+
+    With `admission`, the pool is pushed past a limit on live fibers instead;
+    see `check_admission`.
+
+    Usage: stress [rounds] [fibers per round] [steps per fiber] [workers]
+                  [property_free | admission]
+*/
+
+
+
+namespace {
+
+struct options
+{
+    std::size_t rounds = 200;
+    std::size_t fibers = 10'000;
+    std::size_t steps = 8;
+    std::size_t workers = std::max(2u, std::thread::hardware_concurrency()) - 1;
+    bool        property_free = false;
+    bool        admission = false;
+};
+
+
+/*  Counts down as fibers finish; waiting blocks the calling fiber rather
+    than the thread. Notifies with the lock held, as the waiter may destroy
+    the latch as soon as it sees zero. */
+class fiber_latch
+{
+public:
+    explicit fiber_latch(std::size_t count)
+        : m_count{count}
+    {}
+
+    auto add(std::size_t count) -> void
+    {
+        auto lk = utility::make_unique_lock(m_mutex);
+        m_count += count;
+    }
+
+    auto count_down() -> void
+    {
+        auto lk = utility::make_unique_lock(m_mutex);
+        if (0 == --m_count) {
+            m_condition.notify_all();
+        }
+    }
+
+    auto wait() -> void
+    {
+        auto lk = utility::make_unique_lock(m_mutex);
+        m_condition.wait(lk, [this](){ return 0 == m_count; });
+    }
+
+private:
+    std::mutex                              m_mutex{};
+    boost::fibers::condition_variable_any   m_condition{};
+    std::size_t                             m_count;
+};
+
+
+/*  One per thread; its address tells threads apart even if a thread id were
+    to be reused */
+struct thread_token
+{
+    std::thread::id id = std::this_thread::get_id();
+};
+
+auto this_thread_token() -> thread_token const*
+{
+    thread_local thread_token token{};
+    return &token;
+}
+
+
+std::atomic<std::uint64_t> migrations{0};
+std::atomic<std::uint64_t> steps_taken{0};
+std::atomic<std::uint64_t> fibers_run{0};
+
+
+/*  Where a fiber started, and the check made after every suspension */
+class pin_check
+{
+public:
+    pin_check()
+        : m_thread{std::this_thread::get_id()}
+        , m_token{this_thread_token()}
+    {}
+
+    auto verify(char const * after) -> void
+    {
+        if (std::this_thread::get_id() != m_thread ||
+                this_thread_token() != m_token) {
+            if (migrations.fetch_add(1) < 10) {
+                utility::locked_print("MIGRATED after ", after, ": from ",
+                        m_thread, " to ", std::this_thread::get_id(), "\n");
+            }
+            m_thread = std::this_thread::get_id();
+            m_token = this_thread_token();
+        }
+    }
+
+private:
+    std::thread::id         m_thread;
+    thread_token const *    m_token;
+};
+
+
+/*  Shared by every fiber in a round, whichever thread they are on */
+struct round_state
+{
+    explicit round_state(std::size_t fibers)
+        : done{fibers}
+    {}
+
+    std::array<boost::fibers::mutex, 16>            mutexes{};
+    boost::fibers::buffered_channel<std::uint32_t>  channel{1024};
+    fiber_latch                                     done;
+};
+
+
+auto stressed_fiber(round_state & round, std::size_t seed, std::size_t steps,
+        bool may_spawn) -> void
+{
+    auto check = pin_check{};
+    auto random = std::minstd_rand{static_cast<std::uint32_t>(seed + 1)};
+    auto pick = [&random](std::uint32_t n){ return random() % n; };
+
+    for (auto ii = 0ull; ii != steps; ++ii) {
+        switch (pick(5)) {
+        case 0:
+            boost::this_fiber::yield();
+            check.verify("yield");
+            break;
+        case 1:
+            boost::this_fiber::sleep_for(
+                    std::chrono::microseconds{pick(200)});
+            check.verify("sleep");
+            break;
+        case 2: {
+            auto & mutex = round.mutexes[pick(std::size(round.mutexes))];
+            auto lock = std::unique_lock<boost::fibers::mutex>{mutex};
+            check.verify("mutex lock");
+            boost::this_fiber::yield();
+            check.verify("yield holding a mutex");
+            break;
+        }
+        case 3: {
+            /*  Every fiber pushes before it pops, so there is always a
+                token for a waiting fiber to take */
+            round.channel.push(static_cast<std::uint32_t>(seed));
+            check.verify("channel push");
+            auto token = std::uint32_t{};
+            round.channel.pop(token);
+            check.verify("channel pop");
+            break;
+        }
+        case 4:
+            if (may_spawn && 0 == pick(4)) {
+                round.done.add(1);
+                boost::fibers::fiber([&round, seed, steps](){
+                    stressed_fiber(round, seed * 31, steps, false);
+                }).detach();
+            }
+            break;
+        }
+        steps_taken.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    fibers_run.fetch_add(1, std::memory_order_relaxed);
+    round.done.count_down();
+}
+
+
+/*  The watchdog, state dump and profiler need the activity and properties
+    that only `thread_locked_scheduler` keeps */
+template <typename Scheduler>
+constexpr auto instrumented =
+        std::is_same_v<Scheduler, thread_locked_scheduler>;
+
+template <typename Scheduler>
+struct instruments
+{
+    stall_watchdog<Scheduler>       watchdog{std::chrono::seconds{1}};
+    state_dump_on_signal<Scheduler> dump{};
+    fiber_profiler<Scheduler>       profiler{};
+};
+
+template <typename Scheduler>
+auto name_fiber(char const * name) -> void
+{
+    if constexpr (instrumented<Scheduler>) {
+        boost::this_fiber::properties<thread_locked_props>().set_name(name);
+    }
+}
+
+
+template <typename Scheduler>
+auto run(options const& opts, std::string const& name) -> void
+{
+    auto finished = fiber_latch{1};
+    auto workers = std::vector<std::thread>{};
+    for (auto ii = 0ull; ii != opts.workers; ++ii) {
+        workers.emplace_back([&opts, &finished](){
+            boost::fibers::use_scheduling_algorithm<Scheduler>(
+                    opts.workers + 1);
+            finished.wait();
+        });
+    }
+    boost::fibers::use_scheduling_algorithm<Scheduler>(opts.workers + 1, true);
+
+    utility::locked_print(name, ": ", opts.workers, " workers, ", opts.rounds,
+            " rounds of ", opts.fibers, " fibers, ", opts.steps,
+            " steps each\n");
+
+    auto tools = std::unique_ptr<instruments<Scheduler>>{};
+    if constexpr (instrumented<Scheduler>) {
+        tools = std::make_unique<instruments<Scheduler>>();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto report = [&start](std::size_t round){
+        auto elapsed = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+        utility::locked_print(std::fixed, std::setprecision(0),
+                "round ", std::setw(5), round, "  ",
+                std::setw(10), fibers_run.load() / elapsed, " fibers/s  ",
+                std::setw(10), steps_taken.load() / elapsed, " steps/s  ",
+                "migrations ", migrations.load(), "\n");
+    };
+
+    for (auto round = 0ull; round != opts.rounds; ++round) {
+        auto state = round_state{opts.fibers};
+        for (auto ii = 0ull; ii != opts.fibers; ++ii) {
+            auto seed = round * opts.fibers + ii;
+            boost::fibers::fiber([&state, seed, &opts](){
+                name_fiber<Scheduler>(0 == seed % 2 ? "stressed" : "odd");
+                stressed_fiber(state, seed, opts.steps, true);
+            }).detach();
+        }
+        state.done.wait();
+
+        if ((round + 1) % 10 == 0 || round + 1 == opts.rounds) {
+            report(round + 1);
+        }
+    }
+
+    /*  They look at the schedulers, so go before the workers do */
+    if (tools) {
+        tools->profiler.stop();
+        utility::locked_print("watchdog: ", tools->watchdog.stall_count(),
+                " stalls, profiler: ", tools->profiler.sample_count(),
+                " samples, ", tools->profiler.dropped_count(), " dropped\n");
+        tools.reset();
+    }
+
+    finished.count_down();
+    for (auto && worker : workers) {
+        worker.join();
+    }
+}
+
+
+/*  Admission control, with `thread_locked_scheduler`. Every scheduler is
+    filled to a small limit of live fibers, which hold their places for a
+    while: `redirect` has to go round a scheduler that was filled first,
+    then with every scheduler full, `redirect` and `reject` must throw, and
+    `block` must wait until the fibers holding places end. Once everything
+    has finished, the gauges of every scheduler must be back at 0. Returns
+    the number of checks that failed. */
+auto check_admission(options const& opts) -> std::size_t
+{
+    using namespace std::chrono_literals;
+    using scheduler = thread_locked_scheduler;
+    constexpr auto limit = std::size_t{8};
+
+    auto finished = fiber_latch{1};
+    auto workers = std::vector<std::thread>{};
+    for (auto ii = 0ull; ii != opts.workers; ++ii) {
+        workers.emplace_back([&opts, &finished](){
+            boost::fibers::use_scheduling_algorithm<scheduler>(
+                    opts.workers + 1);
+            finished.wait();
+        });
+    }
+    boost::fibers::use_scheduling_algorithm<scheduler>(opts.workers + 1, true);
+
+    auto count = scheduler::scheduler_count();
+    utility::locked_print("admission: ", count, " schedulers, a limit of ",
+            limit, " fibers each\n");
+
+    auto failures = std::size_t{0};
+    auto fail = [&failures](auto const& ... args){
+        ++failures;
+        utility::locked_print("FAILED: ", args..., "\n");
+    };
+
+    auto done = fiber_latch{0};
+    auto release_at = std::chrono::steady_clock::now() + 200ms;
+    auto hold = [&done, release_at](){
+        boost::this_fiber::sleep_until(release_at);
+        done.count_down();
+    };
+
+    /*  The first scheduler is filled directly, so that spawns placed on it
+        have to go elsewhere */
+    scheduler::set_admission_limit(limit, overload_policy::redirect);
+    try {
+        for (auto ii = std::size_t{0}; ii != limit; ++ii) {
+            done.add(1);
+            scheduler::spawn_on(0, hold).detach();
+        }
+        for (auto ii = std::size_t{0}; ii != (count - 1) * limit; ++ii) {
+            done.add(1);
+            scheduler::spawn(hold).detach();
+        }
+    }
+    catch (admission_error const& error) {
+        done.count_down();
+        fail("redirect turned a fiber away with room to spare: ",
+                error.what());
+    }
+    for (auto ii = std::size_t{0}; ii != count; ++ii) {
+        auto live = scheduler::schedulers()[ii]->gauges().live.load();
+        if (live != limit) {
+            fail("scheduler ", ii, " has ", live, " live fibers, not ", limit);
+        }
+    }
+
+    auto turned_away = [&fail](char const * policy){
+        try {
+            scheduler::spawn([](){}).detach();
+            fail(policy, " let a fiber over the limit");
+        }
+        catch (admission_error const&) {
+        }
+    };
+    turned_away("redirect");
+    scheduler::set_admission_limit(limit, overload_policy::reject);
+    turned_away("reject");
+
+    scheduler::set_admission_limit(limit, overload_policy::block);
+    for (auto ii = std::size_t{0}; ii != count; ++ii) {
+        done.add(1);
+        scheduler::spawn([&done](){ done.count_down(); }).detach();
+        if (std::chrono::steady_clock::now() < release_at) {
+            fail("block spawned a fiber before there was room");
+        }
+    }
+    done.wait();
+
+    /*  A fiber that has finished is only released once it is destroyed,
+        which its own scheduler gets round to shortly */
+    auto settled = [count](){
+        for (auto ii = std::size_t{0}; ii != count; ++ii) {
+            auto const& gauges = scheduler::schedulers()[ii]->gauges();
+            if (0 != gauges.live.load() || 0 != gauges.ready.load() ||
+                    0 != gauges.blocked.load()) {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto deadline = std::chrono::steady_clock::now() + 1s;
+    while (!settled() && std::chrono::steady_clock::now() < deadline) {
+        boost::this_fiber::sleep_for(1ms);
+    }
+    for (auto ii = std::size_t{0}; ii != count; ++ii) {
+        auto const& gauges = scheduler::schedulers()[ii]->gauges();
+        if (0 != gauges.live.load() || 0 != gauges.ready.load() ||
+                0 != gauges.blocked.load()) {
+            fail("scheduler ", ii, " was left with ", gauges.live.load(),
+                    " live, ", gauges.ready.load(), " ready and ",
+                    gauges.blocked.load(), " blocked");
+        }
+    }
+
+    finished.count_down();
+    for (auto && worker : workers) {
+        worker.join();
+    }
+    return failures;
+}
+
+
+auto usage(char const * name, int status = EXIT_FAILURE) -> int
+{
+    auto & out = EXIT_SUCCESS == status ? std::cout : std::cerr;
+    out << "usage: " << name << " [rounds] [fibers per round]"
+            " [steps per fiber] [workers] [property_free | admission]\n"
+            "    counts are whole numbers; fibers and workers at least 1\n";
+    return status;
+}
+
+/*  The whole of `arg` as a count, or nothing */
+auto parse_count(std::string const& arg) -> std::optional<std::size_t>
+{
+    auto value = std::size_t{0};
+    auto last = arg.data() + arg.size();
+    auto [end, error] = std::from_chars(arg.data(), last, value);
+    if (error != std::errc{} || end != last) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+}
+
+
+auto main(int argc, char const * argv[]) -> int
+{
+    auto opts = options{};
+    auto args = std::vector<std::string>(argv + 1, argv + argc);
+    auto fields = std::array<std::size_t *, 4>{
+            &opts.rounds, &opts.fibers, &opts.steps, &opts.workers};
+    auto positional = std::size_t{0};
+    for (auto const& arg : args) {
+        if (arg == "property_free") {
+            opts.property_free = true;
+            continue;
+        }
+        if (arg == "admission") {
+            opts.admission = true;
+            continue;
+        }
+        if (arg == "--help" || arg == "-h") {
+            return usage(argv[0], EXIT_SUCCESS);
+        }
+        auto count = parse_count(arg);
+        if (!count || positional == fields.size()) {
+            std::cerr << "unexpected argument '" << arg << "'\n";
+            return usage(argv[0]);
+        }
+        *fields[positional++] = *count;
+    }
+    if (0 == opts.fibers || 0 == opts.workers) {
+        return usage(argv[0]);
+    }
+
+    if (opts.admission) {
+        if (auto failures = check_admission(opts); 0 != failures) {
+            utility::locked_print("FAILED: ", failures,
+                    " admission checks\n");
+            return EXIT_FAILURE;
+        }
+        utility::locked_print("admission checks passed\n");
+        return EXIT_SUCCESS;
+    }
+    if (opts.property_free) {
+        run<property_free_scheduler>(opts, "property_free_scheduler");
+    } else {
+        run<thread_locked_scheduler>(opts, "thread_locked_scheduler");
+    }
+
+    if (0 != migrations) {
+        utility::locked_print("FAILED: ", migrations.load(),
+                " fibers found themselves on another thread\n");
+        return EXIT_FAILURE;
+    }
+    utility::locked_print("no migrations in ", fibers_run.load(), " fibers\n");
+    return EXIT_SUCCESS;
+}
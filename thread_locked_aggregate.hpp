@@ -0,0 +1,163 @@
+
+//      Copyright CommitThis 2020
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "thread_locked_kv.hpp"
+#include "thread_locked_shards.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+
+
+/*  The groups produced by `hash_aggregate`, left in the table of the shard
+    that owns each key. Once `hash_aggregate` has returned nothing writes to
+    them any more, so they can be read from any thread. */
+template <typename Key, typename Value>
+class aggregate_result
+{
+public:
+    using table_type = open_addressing_table<Key, Value>;
+
+    explicit aggregate_result(std::vector<table_type> tables)
+        : m_tables{std::move(tables)}
+    {}
+
+    auto size() const noexcept -> std::size_t
+    {
+        auto total = std::size_t{0};
+        for (auto const& table : m_tables) {
+            total += table.size();
+        }
+        return total;
+    }
+
+    template <typename Fn>
+    auto for_each(Fn && fn) -> void
+    {
+        for (auto & table : m_tables) {
+            table.for_each(fn);
+        }
+    }
+
+    /*  The table for one shard */
+    auto shard(std::size_t index) noexcept -> table_type &
+    {
+        return m_tables[index];
+    }
+
+    /*  Every group, copied out */
+    auto to_vector() -> std::vector<std::pair<Key, Value>>
+    {
+        auto groups = std::vector<std::pair<Key, Value>>{};
+        groups.reserve(size());
+        for_each([&groups](Key const& key, Value const& value){
+            groups.emplace_back(key, value);
+        });
+        return groups;
+    }
+
+private:
+    std::vector<table_type> m_tables;
+};
+
+
+
+/*  A parallel group-by over the pool, with no aggregation state ever shared
+    between threads.
+
+    `partitions` is a range of ranges of rows, and partition `p` is read by
+    shard `p % shards`. Each row is put in the group for `key_of(row)` and
+    folded into that group's value, which starts as `Value{}`, with
+    `update(value, row)`. It runs in two phases, each a fiber on every shard:
+
+    1.  Each shard aggregates its own partitions, into a table per shard that
+        will own the keys (by `shard_for` of the hash). These tables only
+        hold the keys a shard sees, so stay small enough to keep in cache.
+    2.  Each shard takes the tables meant for it from every shard, and
+        combines the partial values for a key with `merge(into, from)`.
+
+    Rows are hashed a block at a time, in a loop of its own before any of
+    them is looked up, so that the hashing can be vectorised where the
+    instruction set allows and the lookups are not held up behind it.
+
+    Has to be called from a fiber on one of the pool's threads, which the
+    call suspends until both phases are done. The result is left sharded;
+    `aggregate_result::to_vector` gathers it up.
+*/
+template <typename Key, typename Value,
+          typename Hash = std::hash<Key>,
+          typename Scheduler = thread_locked_scheduler,
+          typename Partitions, typename KeyOf, typename Update, typename Merge>
+auto hash_aggregate(Partitions const& partitions, KeyOf key_of,
+        Update update, Merge merge) -> aggregate_result<Key, Value>
+{
+    using table_t = open_addressing_table<Key, Value>;
+    constexpr auto block = std::size_t{256};
+
+    auto shards = Scheduler::scheduler_count();
+    auto count = static_cast<std::size_t>(std::size(partitions));
+
+    /*  `partials[source][owner]`, written in the first phase by `source` and
+        read in the second by `owner` */
+    auto partials = std::vector<std::vector<table_t>>(shards);
+
+    run_on_every_shard<Scheduler>([&](std::size_t source){
+        auto & tables = partials[source];
+        tables.resize(shards);
+        auto hashes = std::array<std::uint64_t, block>{};
+
+        for (auto pp = source; pp < count; pp += shards) {
+            auto const& rows = *std::next(std::begin(partitions), pp);
+            auto row = std::begin(rows);
+            auto const last = std::end(rows);
+            while (row != last) {
+                auto block_end = row;
+                auto filled = std::size_t{0};
+                for (; block_end != last && filled != block;
+                        ++block_end, ++filled) {
+                    hashes[filled] = utility::mix_hash(
+                            Hash{}(key_of(*block_end)));
+                }
+                for (auto ii = std::size_t{0}; ii != filled; ++ii, ++row) {
+                    auto hash = hashes[ii];
+                    auto & table = tables[shard_for<Scheduler>(hash)];
+                    auto value = table.try_emplace(hash, key_of(*row)).first;
+                    update(*value, *row);
+                }
+            }
+        }
+    });
+
+    auto results = std::vector<table_t>(shards);
+    run_on_every_shard<Scheduler>([&](std::size_t owner){
+        auto & result = results[owner];
+        result = std::move(partials[owner][owner]);
+        for (auto source = std::size_t{0}; source != shards; ++source) {
+            if (source == owner) {
+                continue;
+            }
+            partials[source][owner].for_each_hashed(
+                    [&result, &merge](std::uint64_t hash, Key const& key,
+                            Value & value){
+                auto [found, added] = result.try_emplace(hash, key,
+                        std::move(value));
+                if (!added) {
+                    merge(*found, value);
+                }
+            });
+        }
+    });
+
+    return aggregate_result<Key, Value>{std::move(results)};
+}
@@ -0,0 +1,400 @@
+
+//      Copyright CommitThis 2020
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "thread_locked_kv.hpp"
+#include "thread_locked_shards.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+
+/*  What an entry counts against a cache's budget, by default; the size of the
+    key and value themselves, not anything they point to. A cache of strings
+    or vectors wants a cost that includes their contents. */
+struct fixed_cost
+{
+    template <typename Key, typename Value>
+    auto operator()(Key const&, Value const&) const noexcept -> std::size_t
+    {
+        return sizeof(Key) + sizeof(Value);
+    }
+};
+
+
+/*  Counters kept by each cache partition. Only the owning thread writes them
+    (see `utility::owner_add`), and any thread may read them. */
+struct cache_counters
+{
+    std::atomic<std::uint64_t>  hits{0};
+    std::atomic<std::uint64_t>  misses{0};
+    std::atomic<std::uint64_t>  insertions{0};
+    std::atomic<std::uint64_t>  evictions{0};
+    /*  Entries too big to fit the budget at all */
+    std::atomic<std::uint64_t>  rejections{0};
+    std::atomic<std::uint64_t>  entries{0};
+    std::atomic<std::uint64_t>  bytes{0};
+};
+
+/*  A copy of the counters, added up across shards */
+struct cache_totals
+{
+    std::uint64_t   hits{0};
+    std::uint64_t   misses{0};
+    std::uint64_t   insertions{0};
+    std::uint64_t   evictions{0};
+    std::uint64_t   rejections{0};
+    std::uint64_t   entries{0};
+    std::uint64_t   bytes{0};
+
+    auto add(cache_counters const& counters) noexcept -> void
+    {
+        auto read = [](auto const& counter){
+            return counter.load(std::memory_order_relaxed);
+        };
+        hits += read(counters.hits);
+        misses += read(counters.misses);
+        insertions += read(counters.insertions);
+        evictions += read(counters.evictions);
+        rejections += read(counters.rejections);
+        entries += read(counters.entries);
+        bytes += read(counters.bytes);
+    }
+};
+
+
+
+/*  A cache evicting by CLOCK, for use by a single thread.
+
+    Entries sit in a ring swept by a hand. A hit only sets the entry's
+    referenced bit, so lookups never reorder anything; when room is needed,
+    the hand clears the bits it passes and evicts the first entry found
+    without one. A new entry starts without its bit set, so something that
+    is only ever looked up once goes before anything that has been hit since
+    it went in.
+
+    Keys are found through an `open_addressing_table` of positions in the
+    ring, so each key is stored twice; `Cost` should allow for that if keys
+    are large. */
+template <typename Key, typename Value, typename Cost = fixed_cost>
+class clock_cache
+{
+public:
+    explicit clock_cache(std::size_t budget)
+        : m_index{}
+        , m_ring{}
+        , m_free{}
+        , m_hand{0}
+        , m_budget{budget}
+        , m_used{0}
+        , m_counters{}
+    {}
+
+    /*  The value for `key`, or nullptr; only valid until the cache is next
+        changed */
+    auto find(std::uint64_t hash, Key const& key) noexcept -> Value *
+    {
+        auto position = m_index.find(hash, key);
+        if (nullptr == position) {
+            utility::owner_add(m_counters.misses, std::uint64_t{1});
+            return nullptr;
+        }
+        utility::owner_add(m_counters.hits, std::uint64_t{1});
+        auto & entry = m_ring[*position];
+        entry.referenced = true;
+        return &entry.item->second;
+    }
+
+    /*  Adds or replaces the value for `key`, evicting as much as it takes to
+        stay within budget. Returns false, and leaves the cache as it was, if
+        the entry would not fit even in an empty cache. */
+    auto insert(std::uint64_t hash, Key const& key, Value value) -> bool
+    {
+        auto cost = Cost{}(key, value);
+        if (cost > m_budget) {
+            utility::owner_add(m_counters.rejections, std::uint64_t{1});
+            return false;
+        }
+        erase(hash, key);
+        while (m_used + cost > m_budget) {
+            evict();
+        }
+
+        auto position = std::size_t{0};
+        if (!m_free.empty()) {
+            position = m_free.back();
+            m_free.pop_back();
+        } else {
+            position = std::size(m_ring);
+            m_ring.emplace_back();
+        }
+        auto & entry = m_ring[position];
+        entry.item.emplace(key, std::move(value));
+        entry.hash = hash;
+        entry.cost = cost;
+        entry.referenced = false;
+        m_index.insert_or_assign(hash, key, position);
+
+        m_used += cost;
+        utility::owner_add(m_counters.insertions, std::uint64_t{1});
+        publish();
+        return true;
+    }
+
+    /*  Returns whether `key` was there */
+    auto erase(std::uint64_t hash, Key const& key) -> bool
+    {
+        auto position = m_index.find(hash, key);
+        if (nullptr == position) {
+            return false;
+        }
+        remove(*position);
+        publish();
+        return true;
+    }
+
+    auto counters() const noexcept -> cache_counters const&
+    {
+        return m_counters;
+    }
+
+    auto size() const noexcept -> std::size_t
+    {
+        return m_index.size();
+    }
+
+    auto used() const noexcept -> std::size_t
+    {
+        return m_used;
+    }
+
+    auto budget() const noexcept -> std::size_t
+    {
+        return m_budget;
+    }
+
+private:
+    struct entry
+    {
+        std::optional<std::pair<Key, Value>>    item{};
+        std::uint64_t                           hash{0};
+        std::size_t                             cost{0};
+        bool                                    referenced{false};
+    };
+
+    /*  Sweeps the hand round to the first entry not referenced since it last
+        passed, and evicts that. Only called with something in the cache. */
+    auto evict() -> void
+    {
+        for (;;) {
+            auto position = m_hand;
+            m_hand = (m_hand + 1) % std::size(m_ring);
+            auto & entry = m_ring[position];
+            if (!entry.item) {
+                continue;
+            }
+            if (entry.referenced) {
+                entry.referenced = false;
+                continue;
+            }
+            remove(position);
+            utility::owner_add(m_counters.evictions, std::uint64_t{1});
+            return;
+        }
+    }
+
+    auto remove(std::size_t position) -> void
+    {
+        auto & entry = m_ring[position];
+        m_index.erase(entry.hash, entry.item->first);
+        m_used -= entry.cost;
+        entry.item.reset();
+        m_free.push_back(position);
+    }
+
+    auto publish() noexcept -> void
+    {
+        m_counters.entries.store(m_index.size(), std::memory_order_relaxed);
+        m_counters.bytes.store(m_used, std::memory_order_relaxed);
+    }
+
+    open_addressing_table<Key, std::size_t> m_index;
+    std::vector<entry>                      m_ring;
+    /*  Positions in the ring left empty by evictions and erasures */
+    std::vector<std::size_t>                m_free;
+    std::size_t                             m_hand;
+    std::size_t                             m_budget;
+    std::size_t                             m_used;
+    cache_counters                          m_counters;
+};
+
+
+
+/*  A cache split into one `clock_cache` per scheduler in the pool, each with
+    an equal share of the budget.
+
+    Like `sharded_kv_store`, a key's hash picks the shard that owns it, and
+    every lookup, insertion and eviction runs on that shard's thread, so no
+    partition is ever locked. Lookups for keys on other shards cost a fiber
+    spawned on the owner, so `get_many` batches them up by shard.
+
+    The counters for each shard can be read at any time, from any thread.
+    Operations have to be made from fibers on the pool's threads, and the
+    cache has to be created once the pool is up.
+*/
+template <typename Key, typename Value,
+          typename Hash = std::hash<Key>,
+          typename Cost = fixed_cost,
+          typename Scheduler = thread_locked_scheduler>
+class sharded_cache
+{
+public:
+    using partition_type = clock_cache<Key, Value, Cost>;
+
+    /*  `budget` is in whatever units `Cost` gives, bytes by default. Split
+        between the shards, it has to leave each of them something, or
+        `std::invalid_argument` is thrown. */
+    explicit sharded_cache(std::size_t budget)
+        : m_partitions(Scheduler::scheduler_count())
+    {
+        auto each = budget / std::size(m_partitions);
+        if (0 == each) {
+            throw std::invalid_argument{"cache budget of " +
+                    std::to_string(budget) + " is too small to share between " +
+                    std::to_string(std::size(m_partitions)) + " shards"};
+        }
+        for (auto & partition : m_partitions) {
+            partition = std::make_unique<shard>(each);
+        }
+    }
+
+    sharded_cache(sharded_cache const&) = delete;
+    auto operator=(sharded_cache const&) -> sharded_cache & = delete;
+
+
+    auto get(Key const& key) -> std::optional<Value>
+    {
+        auto hash = hash_of(key);
+        return run_on_shard<Scheduler>(shard_for<Scheduler>(hash),
+                [this, hash, &key](){ return get_here(hash, key); });
+    }
+
+    /*  Returns false if the entry is too big to be cached */
+    auto put(Key const& key, Value value) -> bool
+    {
+        auto hash = hash_of(key);
+        return run_on_shard<Scheduler>(shard_for<Scheduler>(hash),
+                [this, hash, &key, &value](){
+            return owner(hash).insert(hash, key, std::move(value));
+        });
+    }
+
+    auto erase(Key const& key) -> bool
+    {
+        auto hash = hash_of(key);
+        return run_on_shard<Scheduler>(shard_for<Scheduler>(hash),
+                [this, hash, &key](){ return owner(hash).erase(hash, key); });
+    }
+
+    /*  The cached value for `key`, or else what `load(key)` returns, which is
+        then cached. `load` runs on the owning shard's thread and may suspend;
+        other fibers missing on the same key meanwhile will load it too. */
+    template <typename Load>
+    auto get_or_load(Key const& key, Load && load) -> Value
+    {
+        auto hash = hash_of(key);
+        return run_on_shard<Scheduler>(shard_for<Scheduler>(hash),
+                [this, hash, &key, &load]() -> Value {
+            if (auto cached = get_here(hash, key)) {
+                return std::move(*cached);
+            }
+            auto value = Value{load(key)};
+            owner(hash).insert(hash, key, value);
+            return value;
+        });
+    }
+
+    /*  The cached value for each of `keys`, in the same order */
+    auto get_many(std::vector<Key> const& keys)
+            -> std::vector<std::optional<Value>>
+    {
+        auto hashes = std::vector<std::uint64_t>(std::size(keys));
+        for (auto ii = std::size_t{0}; ii != std::size(keys); ++ii) {
+            hashes[ii] = hash_of(keys[ii]);
+        }
+        auto values = std::vector<std::optional<Value>>(std::size(keys));
+        run_by_shard<Scheduler>(hashes,
+                [this, &keys, &hashes, &values](std::size_t ii){
+            values[ii] = get_here(hashes[ii], keys[ii]);
+        });
+        return values;
+    }
+
+
+    auto shard_counters(std::size_t index) const noexcept
+            -> cache_counters const&
+    {
+        return m_partitions[index]->cache.counters();
+    }
+
+    /*  The counters of every shard added up */
+    auto totals() const noexcept -> cache_totals
+    {
+        auto totals = cache_totals{};
+        for (auto const& partition : m_partitions) {
+            totals.add(partition->cache.counters());
+        }
+        return totals;
+    }
+
+    auto shard_of(Key const& key) const -> std::size_t
+    {
+        return shard_for<Scheduler>(hash_of(key));
+    }
+
+private:
+    struct alignas(utility::cache_line_size) shard
+    {
+        explicit shard(std::size_t budget)
+            : cache{budget}
+        {}
+
+        partition_type  cache;
+    };
+
+    static auto hash_of(Key const& key) -> std::uint64_t
+    {
+        return utility::mix_hash(Hash{}(key));
+    }
+
+    auto get_here(std::uint64_t hash, Key const& key) -> std::optional<Value>
+    {
+        if (auto found = owner(hash).find(hash, key)) {
+            return *found;
+        }
+        return std::nullopt;
+    }
+
+    auto owner(std::uint64_t hash) noexcept -> partition_type &
+    {
+        BOOST_ASSERT_MSG(
+                Scheduler::current_index() == shard_for<Scheduler>(hash),
+                "shard touched from a thread other than its own");
+        return m_partitions[shard_for<Scheduler>(hash)]->cache;
+    }
+
+    std::vector<std::unique_ptr<shard>> m_partitions;
+};
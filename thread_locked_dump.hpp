@@ -0,0 +1,221 @@
+
+//      Copyright CommitThis 2020
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "thread_locked_scheduler.hpp"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <ostream>
+#include <sstream>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <boost/fiber/operations.hpp>
+
+
+
+/*  Prints the state of every scheduler in the pool: how many fibers are
+    ready, sleeping and live, each fiber the scheduler has resumed with its
+    state, how long since the scheduler last switched fibers, and whether it
+    is idle. With `accounting_stats`, each fiber's accounting is shown too,
+    followed by the totals for each fiber name, most CPU time first.
+
+    The world is not stopped; each scheduler takes its own snapshot the next
+    time it switches, which only holds up that scheduler for as long as it
+    takes to walk its fibers. A scheduler that does not answer within
+    `timeout` is stuck in a fiber that is not yielding, and is shown as such
+    along with what it last published.
+
+    Waits by sleeping the calling fiber, so can be called from a fiber on one
+    of the schedulers as well as from any other thread. */
+template <typename Scheduler = thread_locked_scheduler>
+auto dump_state(std::ostream & out,
+        std::chrono::milliseconds timeout = std::chrono::milliseconds{100})
+        -> void
+{
+    using namespace std::chrono;
+
+    auto const& schedulers = Scheduler::schedulers();
+    auto count = Scheduler::scheduler_count();
+
+    auto taken = std::vector<std::uint64_t>(count);
+    for (auto ii = std::size_t{0}; ii != count; ++ii) {
+        taken[ii] = schedulers[ii]->snapshots_taken();
+        schedulers[ii]->request_snapshot();
+    }
+
+    auto deadline = steady_clock::now() + timeout;
+    auto answered = [&](std::size_t ii){
+        return schedulers[ii]->snapshots_taken() != taken[ii];
+    };
+    for (auto ii = std::size_t{0}; ii != count; ++ii) {
+        while (!answered(ii) && steady_clock::now() < deadline) {
+            boost::this_fiber::sleep_for(milliseconds{1});
+        }
+    }
+
+    auto millis = [](std::uint64_t ticks){
+        return duration<double, std::milli>{
+                utility::cycle_clock::to_duration(ticks)}.count();
+    };
+
+    /*  Built up first and written in one go, so that it is not interleaved
+        with other output */
+    auto text = std::ostringstream{};
+    text << std::fixed << std::setprecision(1);
+    auto now = utility::coarse_clock::now().time_since_epoch();
+    for (auto ii = std::size_t{0}; ii != count; ++ii) {
+        auto & scheduler = *schedulers[ii];
+        auto const& activity = scheduler.activity();
+        auto const& gauges = scheduler.gauges();
+        auto since_switch = duration_cast<milliseconds>(now -
+                utility::coarse_clock::duration{
+                    activity.last_switch.load(std::memory_order_relaxed)});
+        auto suspended = activity.suspended.load(std::memory_order_relaxed);
+
+        text << "scheduler " << ii << ": ";
+        if (!answered(ii)) {
+            text << "not responding, ready "
+                 << gauges.ready.load(std::memory_order_relaxed)
+                 << ", live " << gauges.live.load(std::memory_order_relaxed)
+                 << ", last switch " << since_switch.count()
+                 << "ms ago to fiber " << context::id{
+                    activity.running.load(std::memory_order_relaxed)} << "\n";
+            continue;
+        }
+
+        auto snapshot = scheduler.last_snapshot();
+        text << (suspended ? "idle" : "busy") << ", ready " << snapshot.ready
+             << ", live " << snapshot.live << ", sleeping " << snapshot.sleeping
+             << ", last switch " << since_switch.count() << "ms ago\n";
+        for (auto const& fiber : snapshot.fibers) {
+            text << "    fiber " << fiber.id << " " << to_string(fiber.state);
+            if (!fiber.name.empty()) {
+                text << " \"" << fiber.name << "\"";
+            }
+            if (0 != fiber.accounting.resumes) {
+                text << ", resumed " << fiber.accounting.resumes
+                     << ", cpu " << millis(fiber.accounting.cpu_ticks)
+                     << "ms, ready " << millis(fiber.accounting.wait_ticks)
+                     << "ms";
+            }
+            text << "\n";
+        }
+
+        auto totals = std::vector<std::pair<std::string, fiber_totals>>(
+                snapshot.totals.begin(), snapshot.totals.end());
+        std::sort(totals.begin(), totals.end(), [](auto & a, auto & b){
+            return a.second.cpu_ticks > b.second.cpu_ticks;
+        });
+        for (auto const& [name, total] : totals) {
+            text << "    total \"" << name << "\": " << total.fibers
+                 << " fibers, resumed " << total.resumes
+                 << ", cpu " << millis(total.cpu_ticks)
+                 << "ms, ready " << millis(total.wait_ticks) << "ms\n";
+        }
+    }
+
+    auto lock = utility::make_unique_lock(utility::print_mtx);
+    out << text.str() << std::flush;
+}
+
+
+
+/*  Calls `dump_state` whenever the process receives `signal`. The handler
+    only writes to a pipe, and a thread of its own does the dumping. Only one
+    should exist at a time, as the handler is shared. Throws
+    `std::system_error` if the pipe cannot be made. */
+template <typename Scheduler = thread_locked_scheduler>
+class state_dump_on_signal
+{
+public:
+    explicit state_dump_on_signal(int signal = SIGUSR1,
+            std::ostream & out = std::cerr)
+        : m_signal{signal}
+        , m_out{out}
+        , m_thread{}
+    {
+        if (::pipe2(m_pipe, O_CLOEXEC) < 0) {
+            throw std::system_error{errno, std::generic_category(), "pipe2"};
+        }
+        ::fcntl(m_pipe[1], F_SETFL, O_NONBLOCK);
+        s_write_fd.store(m_pipe[1], std::memory_order_release);
+
+        struct sigaction action{};
+        action.sa_handler = &state_dump_on_signal::on_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        ::sigaction(m_signal, &action, &m_previous);
+
+        m_thread = std::thread{[this](){ run(); }};
+    }
+
+    ~state_dump_on_signal()
+    {
+        ::sigaction(m_signal, &m_previous, nullptr);
+        s_write_fd.store(-1, std::memory_order_release);
+        char stop = quit;
+        while (::write(m_pipe[1], &stop, 1) < 0 && errno == EINTR) {}
+        m_thread.join();
+        ::close(m_pipe[0]);
+        ::close(m_pipe[1]);
+    }
+
+    state_dump_on_signal(state_dump_on_signal const&) = delete;
+    auto operator=(state_dump_on_signal const&)
+            -> state_dump_on_signal & = delete;
+
+private:
+    auto run() -> void
+    {
+        char command = 0;
+        for (;;) {
+            auto got = ::read(m_pipe[0], &command, 1);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0 || command == quit) {
+                return;
+            }
+            dump_state<Scheduler>(m_out);
+        }
+    }
+
+    static auto on_signal(int) -> void
+    {
+        auto saved = errno;
+        auto fd = s_write_fd.load(std::memory_order_acquire);
+        if (fd >= 0) {
+            char command = dump;
+            [[maybe_unused]] auto ignored = ::write(fd, &command, 1);
+        }
+        errno = saved;
+    }
+
+    static constexpr char dump = 'd';
+    static constexpr char quit = 'q';
+
+    inline static std::atomic<int> s_write_fd{-1};
+
+    int                 m_signal;
+    std::ostream &      m_out;
+    int                 m_pipe[2]{-1, -1};
+    struct sigaction    m_previous{};
+    std::thread         m_thread;
+};
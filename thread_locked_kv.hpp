@@ -0,0 +1,413 @@
+
+//      Copyright CommitThis 2020
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "thread_locked_shards.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+
+
+/*  A hash table with open addressing and linear probing, for use by a single
+    thread; no locks, no atomics. Callers hash the keys themselves (with
+    `utility::mix_hash` applied), so that a hash worked out once to find the
+    shard is not worked out again to find the slot.
+
+    Each slot has its hash kept in an array of its own, so that probing runs
+    along a dense array of integers and only touches a key to confirm a
+    match. Deleting shifts the following entries back rather than leaving
+    tombstones, so lookups never slow down as entries come and go. */
+template <typename Key, typename Value, typename Equal = std::equal_to<Key>>
+class open_addressing_table
+{
+public:
+    explicit open_addressing_table(std::size_t capacity = 0)
+        : m_tags{}
+        , m_entries{}
+        , m_size{0}
+    {
+        resize(capacity_for(capacity));
+    }
+
+    /*  The value for `key`, or nullptr */
+    auto find(std::uint64_t hash, Key const& key) noexcept -> Value *
+    {
+        auto slot = locate(tag_of(hash), key);
+        return slot == no_slot ? nullptr : &m_entries[slot]->second;
+    }
+
+    /*  The value for `key`, constructing it from `args` if there is none.
+        Also returns whether it was constructed. */
+    template <typename ... Args>
+    auto try_emplace(std::uint64_t hash, Key const& key, Args && ... args)
+            -> std::pair<Value *, bool>
+    {
+        auto tag = tag_of(hash);
+        if (auto slot = locate(tag, key); slot != no_slot) {
+            return {&m_entries[slot]->second, false};
+        }
+        if ((m_size + 1) * 4 > std::size(m_tags) * 3) {
+            resize(std::size(m_tags) * 2);
+        }
+        auto slot = free_slot(tag);
+        m_tags[slot] = tag;
+        m_entries[slot].emplace(std::piecewise_construct,
+                std::forward_as_tuple(key),
+                std::forward_as_tuple(std::forward<Args>(args)...));
+        ++m_size;
+        return {&m_entries[slot]->second, true};
+    }
+
+    /*  Sets the value for `key`, returning whether it was new */
+    template <typename V>
+    auto insert_or_assign(std::uint64_t hash, Key const& key, V && value)
+            -> bool
+    {
+        auto [found, inserted] = try_emplace(hash, key, std::forward<V>(value));
+        if (!inserted) {
+            *found = std::forward<V>(value);
+        }
+        return inserted;
+    }
+
+    /*  Removes `key`, returning whether it was there */
+    auto erase(std::uint64_t hash, Key const& key) noexcept -> bool
+    {
+        auto hole = locate(tag_of(hash), key);
+        if (hole == no_slot) {
+            return false;
+        }
+        /*  Moves back every entry after the hole that would not be found
+            from its home slot with the hole left empty */
+        auto mask = std::size(m_tags) - 1;
+        for (auto next = (hole + 1) & mask; 0 != m_tags[next];
+                next = (next + 1) & mask) {
+            auto home = m_tags[next] & mask;
+            auto between = hole <= next ? (hole < home && home <= next)
+                                        : (hole < home || home <= next);
+            if (!between) {
+                m_tags[hole] = m_tags[next];
+                m_entries[hole] = std::move(m_entries[next]);
+                hole = next;
+            }
+        }
+        m_tags[hole] = 0;
+        m_entries[hole].reset();
+        --m_size;
+        return true;
+    }
+
+    template <typename Fn>
+    auto for_each(Fn && fn) -> void
+    {
+        for (auto ii = std::size_t{0}; ii != std::size(m_tags); ++ii) {
+            if (0 != m_tags[ii]) {
+                fn(m_entries[ii]->first, m_entries[ii]->second);
+            }
+        }
+    }
+
+    /*  As `for_each`, also passing each entry's hash as it was given (0 comes
+        back as 1, which finds the same shard and slot); for moving entries
+        to another table without hashing them again */
+    template <typename Fn>
+    auto for_each_hashed(Fn && fn) -> void
+    {
+        for (auto ii = std::size_t{0}; ii != std::size(m_tags); ++ii) {
+            if (0 != m_tags[ii]) {
+                fn(m_tags[ii], m_entries[ii]->first, m_entries[ii]->second);
+            }
+        }
+    }
+
+    auto clear() noexcept -> void
+    {
+        std::fill(m_tags.begin(), m_tags.end(), 0);
+        for (auto & entry : m_entries) {
+            entry.reset();
+        }
+        m_size = 0;
+    }
+
+    auto size() const noexcept -> std::size_t
+    {
+        return m_size;
+    }
+
+    auto capacity() const noexcept -> std::size_t
+    {
+        return std::size(m_tags);
+    }
+
+private:
+    static constexpr auto no_slot = static_cast<std::size_t>(-1);
+
+    /*  Zero marks an empty slot */
+    static constexpr auto tag_of(std::uint64_t hash) noexcept -> std::uint64_t
+    {
+        return 0 == hash ? 1 : hash;
+    }
+
+    /*  A power of two with room for `count` entries */
+    static auto capacity_for(std::size_t count) noexcept -> std::size_t
+    {
+        auto capacity = std::size_t{16};
+        while (capacity * 3 < count * 4) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    auto locate(std::uint64_t tag, Key const& key) const noexcept
+            -> std::size_t
+    {
+        auto mask = std::size(m_tags) - 1;
+        for (auto slot = tag & mask; 0 != m_tags[slot];
+                slot = (slot + 1) & mask) {
+            if (m_tags[slot] == tag && Equal{}(m_entries[slot]->first, key)) {
+                return slot;
+            }
+        }
+        return no_slot;
+    }
+
+    auto free_slot(std::uint64_t tag) const noexcept -> std::size_t
+    {
+        auto mask = std::size(m_tags) - 1;
+        auto slot = tag & mask;
+        while (0 != m_tags[slot]) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    auto resize(std::size_t capacity) -> void
+    {
+        auto tags = std::exchange(m_tags,
+                std::vector<std::uint64_t>(capacity, 0));
+        auto entries = std::exchange(m_entries,
+                std::vector<std::optional<std::pair<Key, Value>>>(capacity));
+        for (auto ii = std::size_t{0}; ii != std::size(tags); ++ii) {
+            if (0 != tags[ii]) {
+                auto slot = free_slot(tags[ii]);
+                m_tags[slot] = tags[ii];
+                m_entries[slot] = std::move(entries[ii]);
+            }
+        }
+    }
+
+    std::vector<std::uint64_t>                          m_tags;
+    std::vector<std::optional<std::pair<Key, Value>>>   m_entries;
+    std::size_t                                         m_size;
+};
+
+
+
+/*  A key-value store split into one partition per scheduler in the pool.
+
+    A key belongs to the shard picked by its hash, and every operation on it
+    runs on that shard's thread, where the partition is an ordinary
+    `open_addressing_table` that nothing else ever touches. An operation from
+    a fiber on another thread is handed to a fiber spawned on the owner (see
+    `run_on_shard`), and the caller is suspended until it is done; this costs
+    a trip through the owner's inbox, so where there are several keys to deal
+    with, the `_many` operations send each shard one fiber for all of its keys
+    and run the shards in parallel.
+
+    Operations have to be made from fibers on the pool's threads, and the
+    store has to be created once the pool is up.
+*/
+template <typename Key, typename Value,
+          typename Hash = std::hash<Key>,
+          typename Scheduler = thread_locked_scheduler>
+class sharded_kv_store
+{
+public:
+    using table_type = open_addressing_table<Key, Value>;
+
+    /*  `capacity` is spread across the shards, as a hint to save the tables
+        growing as they fill */
+    explicit sharded_kv_store(std::size_t capacity = 0)
+        : m_partitions(Scheduler::scheduler_count())
+    {
+        auto each = capacity / std::size(m_partitions);
+        for (auto & partition : m_partitions) {
+            partition = std::make_unique<shard>(each);
+        }
+    }
+
+    sharded_kv_store(sharded_kv_store const&) = delete;
+    auto operator=(sharded_kv_store const&) -> sharded_kv_store & = delete;
+
+
+    auto get(Key const& key) -> std::optional<Value>
+    {
+        auto hash = hash_of(key);
+        return run_on_shard<Scheduler>(shard_for<Scheduler>(hash),
+                [this, hash, &key](){ return get_here(hash, key); });
+    }
+
+    /*  Returns whether `key` is new */
+    auto put(Key const& key, Value value) -> bool
+    {
+        auto hash = hash_of(key);
+        return run_on_shard<Scheduler>(shard_for<Scheduler>(hash),
+                [this, hash, &key, &value](){
+            return put_here(hash, key, std::move(value));
+        });
+    }
+
+    /*  Returns whether `key` was there */
+    auto erase(Key const& key) -> bool
+    {
+        auto hash = hash_of(key);
+        return run_on_shard<Scheduler>(shard_for<Scheduler>(hash),
+                [this, hash, &key](){ return erase_here(hash, key); });
+    }
+
+
+    /*  The value for each of `keys`, in the same order */
+    auto get_many(std::vector<Key> const& keys)
+            -> std::vector<std::optional<Value>>
+    {
+        auto values = std::vector<std::optional<Value>>(std::size(keys));
+        batch(keys, [](Key const& key) -> Key const& { return key; },
+                [this, &keys, &values](std::uint64_t hash, std::size_t ii){
+            values[ii] = get_here(hash, keys[ii]);
+        });
+        return values;
+    }
+
+    /*  Returns how many of the keys were new */
+    auto put_many(std::vector<std::pair<Key, Value>> items) -> std::size_t
+    {
+        auto inserted = std::vector<char>(std::size(items));
+        batch(items,
+                [](auto const& item) -> Key const& { return item.first; },
+                [this, &items, &inserted](std::uint64_t hash, std::size_t ii){
+            inserted[ii] = put_here(hash, items[ii].first,
+                    std::move(items[ii].second));
+        });
+        return std::count(inserted.begin(), inserted.end(), 1);
+    }
+
+    /*  Returns how many of the keys were there */
+    auto erase_many(std::vector<Key> const& keys) -> std::size_t
+    {
+        auto erased = std::vector<char>(std::size(keys));
+        batch(keys, [](Key const& key) -> Key const& { return key; },
+                [this, &keys, &erased](std::uint64_t hash, std::size_t ii){
+            erased[ii] = erase_here(hash, keys[ii]);
+        });
+        return std::count(erased.begin(), erased.end(), 1);
+    }
+
+
+    /*  Entries across every shard. Each count is only updated by its owner,
+        so the total may be slightly out of date while the store is being
+        written to. */
+    auto size() const noexcept -> std::size_t
+    {
+        auto total = std::size_t{0};
+        for (auto const& partition : m_partitions) {
+            total += partition->size.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    auto shard_size(std::size_t index) const noexcept -> std::size_t
+    {
+        return m_partitions[index]->size.load(std::memory_order_relaxed);
+    }
+
+    auto shard_of(Key const& key) const -> std::size_t
+    {
+        return shard_for<Scheduler>(hash_of(key));
+    }
+
+private:
+    /*  A table and its published size, on cache lines of their own */
+    struct alignas(utility::cache_line_size) shard
+    {
+        explicit shard(std::size_t capacity)
+            : table{capacity}
+        {}
+
+        table_type                  table;
+        std::atomic<std::size_t>    size{0};
+    };
+
+    static auto hash_of(Key const& key) -> std::uint64_t
+    {
+        return utility::mix_hash(Hash{}(key));
+    }
+
+    /*  These only run on the owning shard's thread */
+    auto get_here(std::uint64_t hash, Key const& key) -> std::optional<Value>
+    {
+        auto & table = owner(hash).table;
+        if (auto found = table.find(hash, key)) {
+            return *found;
+        }
+        return std::nullopt;
+    }
+
+    auto put_here(std::uint64_t hash, Key const& key, Value && value) -> bool
+    {
+        auto & partition = owner(hash);
+        auto inserted = partition.table.insert_or_assign(hash, key,
+                std::move(value));
+        publish_size(partition);
+        return inserted;
+    }
+
+    auto erase_here(std::uint64_t hash, Key const& key) -> bool
+    {
+        auto & partition = owner(hash);
+        auto erased = partition.table.erase(hash, key);
+        publish_size(partition);
+        return erased;
+    }
+
+    auto owner(std::uint64_t hash) noexcept -> shard &
+    {
+        auto & partition = *m_partitions[shard_for<Scheduler>(hash)];
+        BOOST_ASSERT_MSG(
+                Scheduler::current_index() == shard_for<Scheduler>(hash),
+                "shard touched from a thread other than its own");
+        return partition;
+    }
+
+    static auto publish_size(shard & partition) noexcept -> void
+    {
+        partition.size.store(partition.table.size(),
+                std::memory_order_relaxed);
+    }
+
+    /*  Calls `fn(hash, position)` for each of `items` on its shard's thread */
+    template <typename Items, typename KeyOf, typename Fn>
+    auto batch(Items const& items, KeyOf key_of, Fn fn) -> void
+    {
+        auto hashes = std::vector<std::uint64_t>(std::size(items));
+        for (auto ii = std::size_t{0}; ii != std::size(items); ++ii) {
+            hashes[ii] = hash_of(key_of(items[ii]));
+        }
+        run_by_shard<Scheduler>(hashes, [&hashes, &fn](std::size_t position){
+            fn(hashes[position], position);
+        });
+    }
+
+    std::vector<std::unique_ptr<shard>> m_partitions;
+};
@@ -0,0 +1,581 @@
+
+//      Copyright CommitThis 2020
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "thread_locked_shards.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+
+/*  Counters, gauges and histograms that fibers can update without touching
+    anything another thread writes.
+
+    Each metric has a cell per scheduler in the pool, on a cache line of its
+    own. A fiber updates the cell of the scheduler it is pinned to, which only
+    that thread ever writes, so an update is a plain load and store (see
+    `utility::owner_add`) rather than a locked read-modify-write, and no cache
+    line bounces between cores. Reading a metric adds up the cells; the total
+    can be slightly behind, but never torn.
+
+    Threads without one of the pool's schedulers (or with a main scheduler
+    that does not take part in the work) share one more cell, which they
+    update atomically.
+
+    Metrics can be used on their own, or created through a `metric_registry`,
+    which writes them out in the Prometheus text format. Either way they have
+    to be created once the pool is up.
+*/
+
+
+using metric_labels = std::vector<std::pair<std::string, std::string>>;
+
+
+namespace utility {
+
+/*  Adds to a double that several threads write. `fetch_add` for floating
+    point atomics only arrives in C++20. */
+inline auto atomic_add(std::atomic<double> & value, double amount) noexcept
+        -> void
+{
+    auto current = value.load(std::memory_order_relaxed);
+    while (!value.compare_exchange_weak(current, current + amount,
+            std::memory_order_relaxed)) {}
+}
+
+}
+
+
+/*  Where the cells of a metric are, and which one the calling thread uses */
+template <typename Cell, typename Scheduler>
+class metric_cells
+{
+public:
+    metric_cells()
+        : m_cells(Scheduler::scheduler_count() + 1)
+    {}
+
+    /*  The calling thread's cell, and whether it is shared with other
+        threads */
+    auto local() noexcept -> std::pair<Cell &, bool>
+    {
+        auto index = Scheduler::current_index();
+        if (index >= std::size(m_cells) - 1) {
+            return {m_cells.back(), true};
+        }
+        return {m_cells[index], false};
+    }
+
+    auto begin() noexcept { return m_cells.begin(); }
+    auto end() noexcept { return m_cells.end(); }
+    auto begin() const noexcept { return m_cells.cbegin(); }
+    auto end() const noexcept { return m_cells.cend(); }
+
+private:
+    std::vector<Cell> m_cells;
+};
+
+
+
+/*  Only ever goes up */
+template <typename Scheduler = thread_locked_scheduler>
+class sharded_counter
+{
+public:
+    auto inc(std::uint64_t amount = 1) noexcept -> void
+    {
+        auto [cell, shared] = m_cells.local();
+        if (shared) {
+            cell.value.fetch_add(amount, std::memory_order_relaxed);
+        } else {
+            utility::owner_add(cell.value, amount);
+        }
+    }
+
+    auto value() const noexcept -> std::uint64_t
+    {
+        auto total = std::uint64_t{0};
+        for (auto const& cell : m_cells) {
+            total += cell.value.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    struct alignas(utility::cache_line_size) cell
+    {
+        std::atomic<std::uint64_t> value{0};
+    };
+
+    metric_cells<cell, Scheduler> m_cells;
+};
+
+
+/*  Goes up and down. Each shard holds its own part of the value and reading
+    it adds them together, which suits something counted across the pool,
+    such as requests in flight; `set` sets the calling shard's part. */
+template <typename Scheduler = thread_locked_scheduler>
+class sharded_gauge
+{
+public:
+    auto add(double amount) noexcept -> void
+    {
+        auto [cell, shared] = m_cells.local();
+        if (shared) {
+            utility::atomic_add(cell.value, amount);
+        } else {
+            utility::owner_add(cell.value, amount);
+        }
+    }
+
+    auto sub(double amount) noexcept -> void
+    {
+        add(-amount);
+    }
+
+    auto set(double value) noexcept -> void
+    {
+        m_cells.local().first.value.store(value, std::memory_order_relaxed);
+    }
+
+    auto value() const noexcept -> double
+    {
+        auto total = 0.0;
+        for (auto const& cell : m_cells) {
+            total += cell.value.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    struct alignas(utility::cache_line_size) cell
+    {
+        std::atomic<double> value{0.0};
+    };
+
+    metric_cells<cell, Scheduler> m_cells;
+};
+
+
+/*  Counts observations into buckets by upper bound, as Prometheus does; each
+    bucket's count includes those of the buckets below it only when read. */
+template <typename Scheduler = thread_locked_scheduler>
+class sharded_histogram
+{
+public:
+    struct snapshot
+    {
+        std::vector<double>         bounds;
+        /*  Cumulative, with the last for everything (`+Inf`) */
+        std::vector<std::uint64_t>  buckets;
+        double                      sum;
+        std::uint64_t               count;
+    };
+
+    explicit sharded_histogram(std::vector<double> bounds)
+        : m_bounds{std::move(bounds)}
+        , m_cells{}
+    {
+        std::sort(m_bounds.begin(), m_bounds.end());
+        m_bounds.erase(std::unique(m_bounds.begin(), m_bounds.end()),
+                m_bounds.end());
+        for (auto & cell : m_cells) {
+            cell.buckets.reset(
+                    new std::atomic<std::uint64_t>[std::size(m_bounds) + 1]{});
+        }
+    }
+
+    auto observe(double value) noexcept -> void
+    {
+        auto bucket = static_cast<std::size_t>(std::lower_bound(
+                m_bounds.begin(), m_bounds.end(), value) - m_bounds.begin());
+        auto [cell, shared] = m_cells.local();
+        if (shared) {
+            cell.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+            utility::atomic_add(cell.sum, value);
+        } else {
+            utility::owner_add(cell.buckets[bucket], std::uint64_t{1});
+            utility::owner_add(cell.sum, value);
+        }
+    }
+
+    auto read() const -> snapshot
+    {
+        auto result = snapshot{m_bounds,
+                std::vector<std::uint64_t>(std::size(m_bounds) + 1), 0.0, 0};
+        for (auto const& cell : m_cells) {
+            for (auto ii = std::size_t{0}; ii != std::size(result.buckets);
+                    ++ii) {
+                result.buckets[ii] += cell.buckets[ii].load(
+                        std::memory_order_relaxed);
+            }
+            result.sum += cell.sum.load(std::memory_order_relaxed);
+        }
+        for (auto ii = std::size_t{1}; ii < std::size(result.buckets); ++ii) {
+            result.buckets[ii] += result.buckets[ii - 1];
+        }
+        result.count = result.buckets.back();
+        return result;
+    }
+
+private:
+    struct alignas(utility::cache_line_size) histogram_cell
+    {
+        std::unique_ptr<std::atomic<std::uint64_t>[]>   buckets{};
+        std::atomic<double>                             sum{0.0};
+    };
+
+    std::vector<double>                         m_bounds;
+    metric_cells<histogram_cell, Scheduler>     m_cells;
+};
+
+
+
+/*  Creates metrics and writes them out in the Prometheus text format.
+
+    Asking for a metric with the same name and labels as an existing one
+    returns the existing one, so that the registry can be asked at the point
+    of use; asking for it as a different type throws `std::invalid_argument`.
+    Metrics live as long as the registry. Creating them takes a lock, so hold
+    on to the reference rather than asking again on a hot path. */
+template <typename Scheduler = thread_locked_scheduler>
+class metric_registry
+{
+public:
+    using counter_type = sharded_counter<Scheduler>;
+    using gauge_type = sharded_gauge<Scheduler>;
+    using histogram_type = sharded_histogram<Scheduler>;
+
+    auto counter(std::string const& name, std::string const& help,
+            metric_labels labels = {}) -> counter_type &
+    {
+        return *find_or_add<counter_type>(name, help, "counter",
+                std::move(labels), [](){
+            return std::make_unique<counter_type>();
+        }).counter;
+    }
+
+    auto gauge(std::string const& name, std::string const& help,
+            metric_labels labels = {}) -> gauge_type &
+    {
+        return *find_or_add<gauge_type>(name, help, "gauge",
+                std::move(labels), [](){
+            return std::make_unique<gauge_type>();
+        }).gauge;
+    }
+
+    /*  `bounds` only matters the first time a histogram is asked for */
+    auto histogram(std::string const& name, std::string const& help,
+            std::vector<double> bounds, metric_labels labels = {})
+            -> histogram_type &
+    {
+        return *find_or_add<histogram_type>(name, help, "histogram",
+                std::move(labels), [&bounds](){
+            return std::make_unique<histogram_type>(std::move(bounds));
+        }).histogram;
+    }
+
+
+    /*  Every metric, grouped by name */
+    auto write_prometheus(std::ostream & out) const -> void
+    {
+        auto text = std::ostringstream{};
+        {
+            auto lock = std::lock_guard<std::mutex>{ m_mutex };
+            for (auto const& [name, family] : m_families) {
+                text << "# HELP " << name << " " << escaped(family.help, false)
+                     << "\n# TYPE " << name << " " << family.type << "\n";
+                for (auto const& entry : family.entries) {
+                    write_entry(text, name, entry);
+                }
+            }
+        }
+        out << text.str();
+    }
+
+    /*  Writes to a file next to `path` and renames it into place, so that
+        whatever collects it never sees half a file */
+    auto write_file(std::string const& path) const -> void
+    {
+        auto temporary = path + ".tmp";
+        {
+            auto file = std::ofstream{temporary, std::ios::trunc};
+            write_prometheus(file);
+            file.close();
+            if (!file) {
+                throw std::system_error{errno, std::generic_category(),
+                        "writing " + temporary};
+            }
+        }
+        if (0 != std::rename(temporary.c_str(), path.c_str())) {
+            throw std::system_error{errno, std::generic_category(),
+                    "renaming " + temporary};
+        }
+    }
+
+private:
+    struct entry
+    {
+        metric_labels                       labels;
+        std::unique_ptr<counter_type>       counter{};
+        std::unique_ptr<gauge_type>         gauge{};
+        std::unique_ptr<histogram_type>     histogram{};
+    };
+
+    struct family
+    {
+        std::string         help;
+        char const *        type;
+        std::vector<entry>  entries;
+    };
+
+    template <typename Metric, typename Make>
+    auto find_or_add(std::string const& name, std::string const& help,
+            char const * type, metric_labels labels, Make make) -> entry &
+    {
+        auto lock = std::lock_guard<std::mutex>{ m_mutex };
+        auto [found, added] = m_families.try_emplace(name,
+                family{help, type, {}});
+        auto & metrics = found->second;
+        if (0 != std::strcmp(metrics.type, type)) {
+            throw std::invalid_argument{"metric " + name + " is a " +
+                    metrics.type + ", not a " + type};
+        }
+        for (auto & existing : metrics.entries) {
+            if (existing.labels == labels) {
+                return existing;
+            }
+        }
+
+        auto & created = metrics.entries.emplace_back();
+        created.labels = std::move(labels);
+        if constexpr (std::is_same_v<Metric, counter_type>) {
+            created.counter = make();
+        } else if constexpr (std::is_same_v<Metric, gauge_type>) {
+            created.gauge = make();
+        } else {
+            created.histogram = make();
+        }
+        return created;
+    }
+
+    static auto write_entry(std::ostream & out, std::string const& name,
+            entry const& metric) -> void
+    {
+        if (metric.counter) {
+            out << name << label_text(metric.labels) << " "
+                << metric.counter->value() << "\n";
+        } else if (metric.gauge) {
+            out << name << label_text(metric.labels) << " "
+                << number(metric.gauge->value()) << "\n";
+        } else {
+            auto read = metric.histogram->read();
+            for (auto ii = std::size_t{0}; ii != std::size(read.buckets);
+                    ++ii) {
+                auto labels = metric.labels;
+                labels.emplace_back("le", ii < std::size(read.bounds)
+                        ? number(read.bounds[ii]) : "+Inf");
+                out << name << "_bucket" << label_text(labels) << " "
+                    << read.buckets[ii] << "\n";
+            }
+            out << name << "_sum" << label_text(metric.labels) << " "
+                << number(read.sum) << "\n"
+                << name << "_count" << label_text(metric.labels) << " "
+                << read.count << "\n";
+        }
+    }
+
+    /*  The shortest of the two that reads back as the same value, so that a
+        bound of 0.1 is not written as 0.10000000000000001 */
+    static auto number(double value) -> std::string
+    {
+        auto text = std::string{};
+        for (auto precision : {std::numeric_limits<double>::digits10,
+                std::numeric_limits<double>::max_digits10}) {
+            auto out = std::ostringstream{};
+            out.precision(precision);
+            out << value;
+            text = out.str();
+            if (std::strtod(text.c_str(), nullptr) == value) {
+                break;
+            }
+        }
+        return text;
+    }
+
+    static auto label_text(metric_labels const& labels) -> std::string
+    {
+        if (labels.empty()) {
+            return {};
+        }
+        auto text = std::string{"{"};
+        for (auto const& [key, value] : labels) {
+            if (text.size() > 1) {
+                text += ",";
+            }
+            text += key + "=\"" + escaped(value, true) + "\"";
+        }
+        return text + "}";
+    }
+
+    /*  Backslashes and new lines are escaped in help text, and double quotes
+        as well in label values */
+    static auto escaped(std::string const& text, bool quotes) -> std::string
+    {
+        auto result = std::string{};
+        for (auto c : text) {
+            if (c == '\\') {
+                result += "\\\\";
+            } else if (c == '\n') {
+                result += "\\n";
+            } else if (quotes && c == '"') {
+                result += "\\\"";
+            } else {
+                result += c;
+            }
+        }
+        return result;
+    }
+
+    mutable std::mutex              m_mutex{};
+    std::map<std::string, family>   m_families{};
+};
+
+
+
+/*  Serves a registry on a Unix domain socket from a thread of its own: each
+    connection is sent the current metrics and closed. For a local agent to
+    collect, or by hand with `socat - UNIX-CONNECT:<path>`. A client that
+    stops reading is given up on after a second. A socket file left at the
+    path is replaced, but anything else there is left alone and the
+    constructor throws; the socket is removed again on destruction. */
+template <typename Scheduler = thread_locked_scheduler>
+class metrics_socket
+{
+public:
+    metrics_socket(metric_registry<Scheduler> const& registry,
+            std::string path)
+        : m_registry{registry}
+        , m_path{std::move(path)}
+        , m_stopping{false}
+        , m_thread{}
+    {
+        auto address = sockaddr_un{};
+        address.sun_family = AF_UNIX;
+        if (std::size(m_path) >= sizeof(address.sun_path)) {
+            throw std::invalid_argument{"socket path too long: " + m_path};
+        }
+        std::strcpy(address.sun_path, m_path.c_str());
+
+        m_socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (m_socket < 0) {
+            throw std::system_error{errno, std::generic_category(), "socket"};
+        }
+        /*  Only a socket left behind is replaced; anything else at the path
+            makes the bind fail */
+        struct stat existing{};
+        if (0 == ::lstat(m_path.c_str(), &existing) &&
+                S_ISSOCK(existing.st_mode)) {
+            ::unlink(m_path.c_str());
+        }
+        if (0 != ::bind(m_socket, reinterpret_cast<sockaddr *>(&address),
+                    sizeof(address)) || 0 != ::listen(m_socket, 8)) {
+            auto error = errno;
+            ::close(m_socket);
+            throw std::system_error{error, std::generic_category(),
+                    "listening on " + m_path};
+        }
+
+        m_thread = std::thread{[this](){ run(); }};
+    }
+
+    ~metrics_socket()
+    {
+        m_stopping.store(true, std::memory_order_relaxed);
+        m_thread.join();
+        ::close(m_socket);
+        ::unlink(m_path.c_str());
+    }
+
+    metrics_socket(metrics_socket const&) = delete;
+    auto operator=(metrics_socket const&) -> metrics_socket & = delete;
+
+private:
+    /*  Polls with a timeout, so that the destructor does not have to wake
+        it up */
+    auto run() -> void
+    {
+        while (!m_stopping.load(std::memory_order_relaxed)) {
+            auto waiting = pollfd{m_socket, POLLIN, 0};
+            if (::poll(&waiting, 1, 100) <= 0) {
+                continue;
+            }
+            auto client = ::accept4(m_socket, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) {
+                continue;
+            }
+            /*  A client that connects and never reads would otherwise hold
+                up this thread, and the destructor with it, for good */
+            auto timeout = timeval{send_timeout_s, 0};
+            ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                    sizeof(timeout));
+            auto text = std::ostringstream{};
+            m_registry.write_prometheus(text);
+            auto body = text.str();
+            for (auto sent = std::size_t{0}; sent < std::size(body);) {
+                auto written = ::send(client, body.data() + sent,
+                        std::size(body) - sent, MSG_NOSIGNAL);
+                if (written < 0 && errno == EINTR &&
+                        !m_stopping.load(std::memory_order_relaxed)) {
+                    continue;
+                }
+                if (written <= 0) {
+                    break;
+                }
+                sent += static_cast<std::size_t>(written);
+            }
+            ::close(client);
+        }
+    }
+
+    /*  How long a send may wait on a client that is not reading */
+    static constexpr auto send_timeout_s = 1;
+
+    metric_registry<Scheduler> const&   m_registry;
+    std::string                         m_path;
+    int                                 m_socket{-1};
+    std::atomic<bool>                   m_stopping;
+    std::thread                         m_thread;
+};
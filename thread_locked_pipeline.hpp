@@ -0,0 +1,642 @@
+
+//      Copyright CommitThis 2020
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "thread_locked_shards.hpp"
+
+#include <boost/fiber/context.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+
+/*  A bounded ring between one producing fiber and one consuming fiber,
+    which may be on different threads.
+
+    Moving items through it takes no locks: each side owns one index, on a
+    cache line of its own, and keeps a copy of the other side's so that it
+    only has to read the other's line when the ring looks full or empty.
+    Items go in and out in batches, so the indices are only published once
+    per batch.
+
+    A side that has to wait (the consumer for an empty ring, the producer for
+    a full one) parks its fiber, leaving its context where the other side
+    will find it, and suspends; the other side hands the context straight
+    back to its scheduler with `schedule`, which for a fiber on another
+    thread goes through that scheduler's remote ready queue. Neither side
+    ever takes a lock, or suspends just to wake the other. */
+template <typename T>
+class spsc_channel
+{
+    using context = boost::fibers::context;
+
+public:
+    explicit spsc_channel(std::size_t capacity)
+        : m_capacity{round_up(capacity)}
+        , m_slots{new slot[m_capacity]}
+    {}
+
+    ~spsc_channel()
+    {
+        auto head = m_head.load(std::memory_order_relaxed);
+        auto tail = m_tail.load(std::memory_order_relaxed);
+        for (; head != tail; ++head) {
+            item(head).~T();
+        }
+    }
+
+    spsc_channel(spsc_channel const&) = delete;
+    auto operator=(spsc_channel const&) -> spsc_channel & = delete;
+
+
+    /*  Producer: moves `items` in, waiting for room as needed. Returns false,
+        having moved in only some, if the consumer has cancelled. */
+    auto push(std::vector<T> & items) -> bool
+    {
+        auto first = std::size_t{0};
+        while (first != std::size(items)) {
+            first += try_push(items, first);
+            if (first == std::size(items)) {
+                break;
+            }
+            if (!wait(m_producer_parked, [this](){
+                return m_cancelled.load(std::memory_order_relaxed) ||
+                        free_space() != 0;
+            })) {
+                return false;
+            }
+        }
+        return !m_cancelled.load(std::memory_order_relaxed);
+    }
+
+    /*  Producer: no more items are coming */
+    auto close() -> void
+    {
+        m_closed.store(true, std::memory_order_release);
+        wake(m_consumer_parked);
+    }
+
+
+    /*  Consumer: moves up to `max` items to the end of `items` without
+        waiting, returning how many */
+    auto try_pop(std::vector<T> & items, std::size_t max) -> std::size_t
+    {
+        auto head = m_head.load(std::memory_order_relaxed);
+        auto available = m_tail_cache - head;
+        if (available == 0) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            available = m_tail_cache - head;
+        }
+        auto count = std::min(available, max);
+        for (auto ii = std::size_t{0}; ii != count; ++ii) {
+            auto & taken = item(head + ii);
+            items.push_back(std::move(taken));
+            taken.~T();
+        }
+        if (count != 0) {
+            m_head.store(head + count, std::memory_order_release);
+            wake(m_producer_parked);
+        }
+        return count;
+    }
+
+    /*  Consumer: waits until there is something to pop, or the producer has
+        closed and everything has been popped, returning false for the
+        latter */
+    auto wait_for_items() -> bool
+    {
+        wait(m_consumer_parked, [this](){
+            return m_tail.load(std::memory_order_acquire) !=
+                    m_head.load(std::memory_order_relaxed) ||
+                    m_closed.load(std::memory_order_acquire);
+        });
+        return m_tail.load(std::memory_order_acquire) !=
+                m_head.load(std::memory_order_relaxed);
+    }
+
+    /*  Consumer: nothing more will be popped; the producer's pushes fail
+        from now on */
+    auto cancel() -> void
+    {
+        m_cancelled.store(true, std::memory_order_relaxed);
+        wake(m_producer_parked);
+    }
+
+    auto capacity() const noexcept -> std::size_t
+    {
+        return m_capacity;
+    }
+
+private:
+    struct slot
+    {
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    static auto round_up(std::size_t capacity) noexcept -> std::size_t
+    {
+        auto rounded = std::size_t{2};
+        while (rounded < capacity) {
+            rounded *= 2;
+        }
+        return rounded;
+    }
+
+    auto item(std::size_t index) noexcept -> T &
+    {
+        return *std::launder(reinterpret_cast<T *>(
+                m_slots[index & (m_capacity - 1)].storage));
+    }
+
+    auto free_space() noexcept -> std::size_t
+    {
+        return m_capacity - (m_tail.load(std::memory_order_relaxed) -
+                m_head.load(std::memory_order_acquire));
+    }
+
+    /*  Producer: moves in as many of `items` from `first` as fit */
+    auto try_push(std::vector<T> & items, std::size_t first) -> std::size_t
+    {
+        auto tail = m_tail.load(std::memory_order_relaxed);
+        auto space = m_capacity - (tail - m_head_cache);
+        if (space < std::size(items) - first) {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            space = m_capacity - (tail - m_head_cache);
+        }
+        auto count = std::min(space, std::size(items) - first);
+        for (auto ii = std::size_t{0}; ii != count; ++ii) {
+            ::new (m_slots[(tail + ii) & (m_capacity - 1)].storage)
+                    T(std::move(items[first + ii]));
+        }
+        if (count != 0) {
+            m_tail.store(tail + count, std::memory_order_release);
+            wake(m_consumer_parked);
+        }
+        return count;
+    }
+
+    /*  Parks the calling fiber until `ready` is true. The fiber is left in
+        `parked` before `ready` is checked one last time, so that the other
+        side either sees it there, or has already made `ready` true. Returns
+        false if it gave up because the channel was cancelled. */
+    template <typename Ready>
+    auto wait(std::atomic<context *> & parked, Ready ready) -> bool
+    {
+        auto self = boost::fibers::context::active();
+        while (!ready()) {
+            parked.store(self, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ready()) {
+                auto expected = self;
+                if (parked.compare_exchange_strong(expected, nullptr,
+                        std::memory_order_relaxed)) {
+                    break;
+                }
+                /*  Too late; the other side has taken the fiber and is
+                    scheduling it, which it has to be suspended to receive */
+            }
+            self->suspend();
+        }
+        return !m_cancelled.load(std::memory_order_relaxed);
+    }
+
+    /*  Schedules the fiber parked on the other side, if there is one. Only
+        touches its line when the fiber is there to be taken. */
+    auto wake(std::atomic<context *> & parked) -> void
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (nullptr != parked.load(std::memory_order_relaxed)) {
+            if (auto waiter = parked.exchange(nullptr,
+                    std::memory_order_relaxed)) {
+                boost::fibers::context::active()->schedule(waiter);
+            }
+        }
+    }
+
+    std::size_t                             m_capacity;
+    std::unique_ptr<slot[]>                 m_slots;
+
+    /*  Consumer's */
+    alignas(utility::cache_line_size)
+    std::atomic<std::size_t>                m_head{0};
+    std::size_t                             m_tail_cache{0};
+    std::atomic<context *>                  m_consumer_parked{nullptr};
+
+    /*  Producer's */
+    alignas(utility::cache_line_size)
+    std::atomic<std::size_t>                m_tail{0};
+    std::size_t                             m_head_cache{0};
+    std::atomic<context *>                  m_producer_parked{nullptr};
+
+    alignas(utility::cache_line_size)
+    std::atomic<bool>                       m_closed{false};
+    std::atomic<bool>                       m_cancelled{false};
+};
+
+
+
+/*  Where a stage runs and how it moves items on. `scheduler` is a position in
+    the pool's `schedulers()`; left as `any_scheduler`, stages are spread over
+    the pool in the order they were added. */
+struct stage_options
+{
+    static constexpr auto any_scheduler = static_cast<std::size_t>(-1);
+
+    std::size_t     scheduler{any_scheduler};
+    /*  Items the channel to the next stage holds before this stage has to
+        wait for it */
+    std::size_t     capacity{1024};
+    /*  Items taken in, and sent on, at a time; 0 is taken as 1 */
+    std::size_t     batch{64};
+};
+
+
+/*  Counted by each stage as it runs, and readable from anywhere. Times are
+    in nanoseconds: `busy` running the stage's function, `starved` waiting
+    for input, `blocked` waiting for room downstream. */
+struct alignas(utility::cache_line_size) stage_stats
+{
+    std::atomic<std::uint64_t>  items_in{0};
+    std::atomic<std::uint64_t>  items_out{0};
+    std::atomic<std::uint64_t>  batches{0};
+    std::atomic<std::uint64_t>  busy{0};
+    std::atomic<std::uint64_t>  starved{0};
+    std::atomic<std::uint64_t>  blocked{0};
+};
+
+
+/*  The output of a stage, to be passed to the one stage that takes it in */
+template <typename T>
+class pipe_end
+{
+public:
+    explicit pipe_end(std::shared_ptr<spsc_channel<T>> channel)
+        : m_channel{std::move(channel)}
+    {}
+
+    auto channel() const noexcept -> std::shared_ptr<spsc_channel<T>> const&
+    {
+        return m_channel;
+    }
+
+private:
+    std::shared_ptr<spsc_channel<T>> m_channel;
+};
+
+
+
+/*  A chain of stages, each a single fiber pinned to a scheduler of its
+    choosing, connected by `spsc_channel`s.
+
+    Since a stage's fiber never leaves its thread, and nothing else runs its
+    function, whatever state the function keeps needs no locking, and stays
+    in the cache of the core it runs on. Several stages can share a
+    scheduler.
+
+        auto flow = pipeline<>{};
+        auto lines = flow.source<std::string>("read", {0}, [&](auto emit){
+            for (auto line = std::string{}; std::getline(in, line);) {
+                if (!emit(std::move(line))) {
+                    return;
+                }
+            }
+        });
+        auto records = flow.stage<record>("parse", lines, {1},
+                [](std::string line, auto emit){ emit(parse(line)); });
+        flow.sink("encode", records, {2}, [&](record r){ out << encode(r); });
+        flow.run();
+
+    A stage takes up to `batch` items at a time from its input, and sends its
+    output on in batches of the same size, or sooner if its input runs dry,
+    so that a batch never waits for items that are not coming. A stage that
+    gets ahead of the next one waits once the channel between them is full;
+    `emit` returns false if everything downstream has stopped.
+
+    If a stage's function throws, the stage stops, the stages before it
+    stop at their next `emit`, the stages after it finish what they have,
+    and `run` rethrows the exception.
+*/
+template <typename Scheduler = thread_locked_scheduler>
+class pipeline
+{
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    /*  A stage with no input; `fn(emit)` produces every item and returns */
+    template <typename Out, typename Fn>
+    auto source(std::string name, stage_options options, Fn fn)
+            -> pipe_end<Out>
+    {
+        auto output = std::make_shared<spsc_channel<Out>>(options.capacity);
+        auto & stats = add(std::move(name), options);
+        m_stages.back().body = [output, fn = std::move(fn), &stats,
+                batch = options.batch]() mutable {
+            auto out = emitter<Out>{output, stats, batch};
+            try {
+                auto start = clock_t::now();
+                fn(std::ref(out));
+                out.finish();
+                auto elapsed = nanoseconds_since(start);
+                utility::owner_add(stats.busy, elapsed - std::min(elapsed,
+                        stats.blocked.load(std::memory_order_relaxed)));
+            }
+            catch (...) {
+                output->close();
+                throw;
+            }
+        };
+        return pipe_end<Out>{output};
+    }
+
+    /*  A stage that calls `fn(item, emit)` for each item of `input`, and may
+        emit any number of items of its own for each */
+    template <typename Out, typename In, typename Fn>
+    auto stage(std::string name, pipe_end<In> input, stage_options options,
+            Fn fn) -> pipe_end<Out>
+    {
+        auto output = std::make_shared<spsc_channel<Out>>(options.capacity);
+        auto & stats = add(std::move(name), options);
+        m_stages.back().body = [input = input.channel(), output,
+                fn = std::move(fn), &stats, batch = options.batch]() mutable {
+            auto out = emitter<Out>{output, stats, batch};
+            try {
+                consume(*input, stats, batch, [&](In && item){
+                    fn(std::move(item), std::ref(out));
+                    return !out.stopped();
+                }, [&](){ out.flush(); });
+                out.finish();
+            }
+            catch (...) {
+                input->cancel();
+                output->close();
+                throw;
+            }
+        };
+        return pipe_end<Out>{output};
+    }
+
+    /*  The last stage; calls `fn(item)` for each item of `input` */
+    template <typename In, typename Fn>
+    auto sink(std::string name, pipe_end<In> input, stage_options options,
+            Fn fn) -> void
+    {
+        auto & stats = add(std::move(name), options);
+        m_stages.back().body = [input = input.channel(), fn = std::move(fn),
+                &stats, batch = options.batch]() mutable {
+            try {
+                consume(*input, stats, batch, [&](In && item){
+                    fn(std::move(item));
+                    return true;
+                }, [](){});
+            }
+            catch (...) {
+                input->cancel();
+                throw;
+            }
+        };
+    }
+
+
+    /*  Starts every stage on its scheduler and waits for them all to finish,
+        then rethrows the first exception from a stage, if any. Has to be
+        called from a fiber on one of the pool's threads, and only once. */
+    auto run() -> void
+    {
+        auto errors = std::vector<std::exception_ptr>(std::size(m_stages));
+        auto fibers = std::vector<boost::fibers::fiber>{};
+        m_started = clock_t::now();
+        for (auto ii = std::size_t{0}; ii != std::size(m_stages); ++ii) {
+            fibers.push_back(Scheduler::spawn_on(m_stages[ii].scheduler,
+                    [this, &errors, ii](){
+                try {
+                    m_stages[ii].body();
+                }
+                catch (...) {
+                    errors[ii] = std::current_exception();
+                }
+                m_stages[ii].finished = clock_t::now();
+            }));
+        }
+        for (auto & fiber : fibers) {
+            fiber.join();
+        }
+        for (auto const& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+
+    auto stage_count() const noexcept -> std::size_t
+    {
+        return std::size(m_stages);
+    }
+
+    auto stats(std::size_t stage) const noexcept -> stage_stats const&
+    {
+        return *m_stages[stage].stats;
+    }
+
+    /*  A line per stage: where it ran, its throughput since `run` started
+        (or until it finished), the time spent on each item, and how its time
+        split between working, waiting for input and waiting for room */
+    auto report(std::ostream & out) const -> void
+    {
+        using namespace std::chrono;
+        auto text = std::ostringstream{};
+        text << std::fixed << std::setprecision(1);
+        for (auto const& each : m_stages) {
+            auto const& stats = *each.stats;
+            auto end = each.finished.load(std::memory_order_relaxed);
+            if (end == clock_t::time_point{}) {
+                end = clock_t::now();
+            }
+            auto elapsed = duration<double>(end - m_started).count();
+            auto read = [](auto const& value){
+                return static_cast<double>(
+                        value.load(std::memory_order_relaxed));
+            };
+            /*  A source only has items out */
+            auto items = std::max(read(stats.items_in), read(stats.items_out));
+            auto total = read(stats.busy) + read(stats.starved) +
+                    read(stats.blocked);
+            auto share = [total](double part){
+                return total > 0 ? 100.0 * part / total : 0.0;
+            };
+            text << std::left << std::setw(16) << each.name << std::right
+                 << " on " << each.scheduler << ": "
+                 << (elapsed > 0 ? items / elapsed : 0.0)
+                 << " items/s, "
+                 << (items > 0 ? read(stats.busy) / items : 0.0)
+                 << " ns/item, busy " << share(read(stats.busy))
+                 << "%, starved " << share(read(stats.starved))
+                 << "%, blocked " << share(read(stats.blocked)) << "%\n";
+        }
+        auto lock = utility::make_unique_lock(utility::print_mtx);
+        out << text.str() << std::flush;
+    }
+
+private:
+    struct stage_record
+    {
+        std::string                         name;
+        std::size_t                         scheduler;
+        std::unique_ptr<stage_stats>        stats;
+        std::function<void()>               body{};
+        std::atomic<clock_t::time_point>    finished{};
+    };
+
+    static auto nanoseconds_since(clock_t::time_point start) noexcept
+            -> std::uint64_t
+    {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<
+                std::chrono::nanoseconds>(clock_t::now() - start).count());
+    }
+
+    /*  Collects a stage's output into batches; passed to the stage's
+        function as `emit` */
+    template <typename Out>
+    class emitter
+    {
+    public:
+        emitter(std::shared_ptr<spsc_channel<Out>> channel,
+                stage_stats & stats, std::size_t batch)
+            : m_channel{std::move(channel)}
+            , m_stats{stats}
+            , m_batch{std::max<std::size_t>(batch, 1)}
+            , m_pending{}
+            , m_stopped{false}
+        {
+            m_pending.reserve(m_batch);
+        }
+
+        auto operator()(Out item) -> bool
+        {
+            if (m_stopped) {
+                return false;
+            }
+            m_pending.push_back(std::move(item));
+            if (std::size(m_pending) >= m_batch) {
+                flush();
+            }
+            return !m_stopped;
+        }
+
+        auto flush() -> void
+        {
+            if (m_pending.empty() || m_stopped) {
+                return;
+            }
+            auto start = clock_t::now();
+            m_stopped = !m_channel->push(m_pending);
+            utility::owner_add(m_stats.blocked, nanoseconds_since(start));
+            utility::owner_add(m_stats.items_out,
+                    static_cast<std::uint64_t>(std::size(m_pending)));
+            m_pending.clear();
+        }
+
+        auto finish() -> void
+        {
+            flush();
+            m_channel->close();
+        }
+
+        auto stopped() const noexcept -> bool
+        {
+            return m_stopped;
+        }
+
+    private:
+        std::shared_ptr<spsc_channel<Out>>  m_channel;
+        stage_stats &                       m_stats;
+        std::size_t                         m_batch;
+        std::vector<Out>                    m_pending;
+        bool                                m_stopped;
+    };
+
+    /*  Feeds `each` with the items of `input` a batch at a time, until the
+        input is closed and empty or `each` returns false. `idle` is called
+        before waiting for more input. Time spent pushing downstream from
+        inside `each` is counted as blocked, and so is left out of busy. */
+    template <typename In, typename Each, typename Idle>
+    static auto consume(spsc_channel<In> & input, stage_stats & stats,
+            std::size_t batch, Each each, Idle idle) -> void
+    {
+        batch = std::max<std::size_t>(batch, 1);
+        auto items = std::vector<In>{};
+        items.reserve(batch);
+        for (;;) {
+            items.clear();
+            if (0 == input.try_pop(items, batch)) {
+                idle();
+                auto start = clock_t::now();
+                auto more = input.wait_for_items();
+                utility::owner_add(stats.starved, nanoseconds_since(start));
+                if (!more) {
+                    return;
+                }
+                input.try_pop(items, batch);
+            }
+
+            auto blocked = stats.blocked.load(std::memory_order_relaxed);
+            auto start = clock_t::now();
+            auto carry_on = true;
+            for (auto & item : items) {
+                if (!(carry_on = each(std::move(item)))) {
+                    break;
+                }
+            }
+            auto elapsed = nanoseconds_since(start);
+            auto waited = stats.blocked.load(std::memory_order_relaxed) -
+                    blocked;
+            utility::owner_add(stats.busy, elapsed - std::min(elapsed, waited));
+            utility::owner_add(stats.items_in,
+                    static_cast<std::uint64_t>(std::size(items)));
+            utility::owner_add(stats.batches, std::uint64_t{1});
+            if (!carry_on) {
+                input.cancel();
+                return;
+            }
+        }
+    }
+
+    auto add(std::string name, stage_options const& options) -> stage_stats &
+    {
+        auto scheduler = options.scheduler;
+        if (scheduler == stage_options::any_scheduler) {
+            scheduler = std::size(m_stages) % Scheduler::scheduler_count();
+        }
+        BOOST_ASSERT(scheduler < Scheduler::scheduler_count());
+        auto & added = m_stages.emplace_back();
+        added.name = std::move(name);
+        added.scheduler = scheduler;
+        added.stats = std::make_unique<stage_stats>();
+        return *added.stats;
+    }
+
+    /*  A deque, as records are never moved once added */
+    std::deque<stage_record>    m_stages{};
+    clock_t::time_point         m_started{};
+};
@@ -0,0 +1,816 @@
+
+//      Copyright CommitThis 2020
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/fiber/context.hpp>
+#include <boost/fiber/scheduler.hpp>
+
+#include "thread_locked_props.hpp"
+
+
+
+namespace utility {
+
+/*  Assumed size of a cache line, for keeping shared data apart. Not using
+    `std::hardware_destructive_interference_size`, as its value is allowed to
+    differ between compiler flags and so is unsafe in a header. */
+inline constexpr std::size_t cache_line_size = 64;
+
+}
+
+
+
+/*  Policies for `basic_thread_locked_scheduler`. A policy is a plain class
+    held by value in each scheduler, and its member functions are called
+    directly; there is no virtual dispatch, so the no-op policies compile away
+    to nothing.
+
+    Placement:  chooses the scheduler a newly awakened fiber is pinned to.
+                `count` is either a `std::size_t`, or a
+                `std::integral_constant` when the worker count is fixed at
+                compile time.
+                    auto next(Count count) noexcept -> std::size_t
+
+    Queue:      the scheduler's ready queue. Only the owning thread uses it,
+                so a queue need not be thread safe itself.
+                    auto push(context *) noexcept -> void
+                    auto pop() noexcept -> context *     (nullptr if empty)
+                    auto empty() const noexcept -> bool
+                    auto requeue(context *) noexcept -> void
+                    auto extract(context::id) noexcept -> context *
+                `requeue` is called when the properties of a queued fiber
+                change, so that it can be moved. `extract` removes a
+                particular fiber, returning nullptr if it is not queued. A
+                queue may also provide
+                    auto wake(context *) noexcept -> void
+                which is used instead of `push` for a fiber made ready by
+                another fiber running on the same thread, rather than by
+                yielding.
+
+    Idle:       how a scheduler without ready fibers waits for more work, and
+                how another thread wakes it up again.
+                    auto suspend_until(time_point const&) noexcept -> void
+                    auto notify() noexcept -> void
+
+    Stats:      hooks called on the scheduler's hot paths. They may be called
+                from threads other than the owning one, so anything stored
+                must be safe to update concurrently.
+*/
+
+
+
+/*  Placement ----------------------------------------------------------------*/
+
+/*  Reduces `value` to an index into a list of `count` schedulers */
+inline auto wrap_index(std::size_t value, std::size_t count) noexcept
+        -> std::size_t
+{
+    return value % count;
+}
+
+/*  When the count is known at compile time and is a power of two, the modulo
+    becomes a mask. */
+template <std::size_t Count>
+constexpr auto wrap_index(std::size_t value,
+        std::integral_constant<std::size_t, Count>) noexcept -> std::size_t
+{
+    static_assert(Count != 0, "a scheduler list cannot be empty");
+    if constexpr ((Count & (Count - 1)) == 0) {
+        return value & (Count - 1);
+    } else {
+        return value % Count;
+    }
+}
+
+
+/*  Hands out schedulers in turn. The cursor is shared by every spawning
+    thread, which is what the original scheduler did. */
+struct round_robin_placement
+{
+    template <typename Count>
+    auto next(Count count) noexcept -> std::size_t
+    {
+        return wrap_index(s_cursor.fetch_add(1, std::memory_order_relaxed),
+                count);
+    }
+
+private:
+    inline static std::atomic<std::size_t> s_cursor{0};
+};
+
+
+/*  Hands out schedulers in turn, with a cursor of its own for each spawning
+    scheduler, so that spawning from several threads does not bounce a
+    shared counter between them. Each cursor starts at a different offset;
+    otherwise schedulers spawning a fiber each at the same time would all
+    send them to the same place. */
+class local_round_robin_placement
+{
+public:
+    local_round_robin_placement() noexcept
+        : m_cursor{s_seed.fetch_add(1, std::memory_order_relaxed)}
+    {
+    }
+
+    template <typename Count>
+    auto next(Count count) noexcept -> std::size_t
+    {
+        return wrap_index(m_cursor++, count);
+    }
+
+private:
+    inline static std::atomic<std::size_t> s_seed{0};
+
+    std::size_t m_cursor;
+};
+
+
+
+/*  Queue --------------------------------------------------------------------*/
+
+/*  Removes the fiber `id` from an intrusive ready queue, if it is there */
+inline auto extract_fiber(boost::fibers::scheduler::ready_queue_type & queue,
+        boost::fibers::context::id id) noexcept -> boost::fibers::context *
+{
+    auto found = std::find_if(queue.begin(), queue.end(),
+            [id](auto const& ctx){ return ctx.get_id() == id; });
+    if (found == queue.end()) {
+        return nullptr;
+    }
+    auto ctx = &*found;
+    queue.erase(found);
+    return ctx;
+}
+
+
+/*  First in, first out; the intrusive ready queue Boost's own schedulers use,
+    so pushing and popping never allocates. */
+class fifo_queue
+{
+    using queue_t = boost::fibers::scheduler::ready_queue_type;
+
+public:
+    auto push(boost::fibers::context * ctx) noexcept -> void
+    {
+        m_queue.push_back(*ctx);
+    }
+
+    auto pop() noexcept -> boost::fibers::context *
+    {
+        if (m_queue.empty()) {
+            return nullptr;
+        }
+        auto ctx = &m_queue.front();
+        m_queue.pop_front();
+        return ctx;
+    }
+
+    auto empty() const noexcept -> bool
+    {
+        return m_queue.empty();
+    }
+
+    /*  Arrival order does not depend on any property */
+    auto requeue(boost::fibers::context *) noexcept -> void
+    {
+    }
+
+    auto extract(boost::fibers::context::id id) noexcept
+            -> boost::fibers::context *
+    {
+        return extract_fiber(m_queue, id);
+    }
+
+private:
+    queue_t m_queue;
+};
+
+
+
+/*  A FIFO lane for each of `Lanes` priorities. A fiber's priority property is
+    clamped to [0, Lanes) and higher lanes are served first, except that a
+    waiting lane passed over `Share` times in favour of a higher one is served
+    next, so lower priorities always get a share. */
+template <std::size_t Lanes = 4, std::size_t Share = 8>
+class priority_lanes
+{
+    static_assert(Lanes > 0, "at least one lane is needed");
+
+    using queue_t = boost::fibers::scheduler::ready_queue_type;
+
+public:
+    auto push(boost::fibers::context * ctx) noexcept -> void
+    {
+        auto & props = *static_cast<thread_locked_props *>(
+                ctx->get_properties());
+        auto lane = static_cast<std::size_t>(std::clamp(props.priority(), 0,
+                static_cast<int>(Lanes - 1)));
+        m_lanes[lane].push_back(*ctx);
+    }
+
+    auto pop() noexcept -> boost::fibers::context *
+    {
+        for (auto lane = std::size_t{0}; lane != Lanes; ++lane) {
+            if (!m_lanes[lane].empty() && m_passed[lane] >= Share) {
+                return take(lane);
+            }
+        }
+        for (auto lane = Lanes; lane != 0; --lane) {
+            if (!m_lanes[lane - 1].empty()) {
+                return take(lane - 1);
+            }
+        }
+        return nullptr;
+    }
+
+    auto empty() const noexcept -> bool
+    {
+        return std::all_of(m_lanes.begin(), m_lanes.end(),
+                [](auto const& lane){ return lane.empty(); });
+    }
+
+    /*  The priority may have changed, so the fiber may belong in another lane.
+        It goes to the back of it. */
+    auto requeue(boost::fibers::context * ctx) noexcept -> void
+    {
+        ctx->ready_unlink();
+        push(ctx);
+    }
+
+    auto extract(boost::fibers::context::id id) noexcept
+            -> boost::fibers::context *
+    {
+        for (auto & lane : m_lanes) {
+            if (auto ctx = extract_fiber(lane, id)) {
+                return ctx;
+            }
+        }
+        return nullptr;
+    }
+
+private:
+    /*  Every waiting lane below `lane` has been passed over once more */
+    auto take(std::size_t lane) noexcept -> boost::fibers::context *
+    {
+        auto ctx = &m_lanes[lane].front();
+        m_lanes[lane].pop_front();
+        m_passed[lane] = 0;
+        for (auto lower = std::size_t{0}; lower != lane; ++lower) {
+            if (!m_lanes[lower].empty()) {
+                ++m_passed[lower];
+            }
+        }
+        return ctx;
+    }
+
+    std::array<queue_t, Lanes>      m_lanes{};
+    std::array<std::size_t, Lanes>  m_passed{};
+};
+
+
+
+/*  Earliest deadline first. Fibers with a deadline property are kept in a
+    binary heap in a contiguous array; ties go in arrival order. Fibers without
+    one, including the scheduler's own dispatcher, wait in a FIFO that is
+    served when no deadline is pending, or after being passed over `Share`
+    times, so timers and remote wake ups are still processed under load.
+
+    A fiber picked after its deadline has passed counts as a miss, but only
+    once for each deadline it is given. Since the
+    heap does not link the fiber into a ready queue, Boost does not report
+    property changes for it; a new deadline takes effect the next time it is
+    awakened. */
+template <std::size_t Share = 8>
+class deadline_queue
+{
+    using queue_t = boost::fibers::scheduler::ready_queue_type;
+    using time_point = std::chrono::steady_clock::time_point;
+
+    struct entry
+    {
+        time_point                  deadline;
+        std::uint64_t               sequence;
+        boost::fibers::context *    ctx;
+    };
+
+    /*  `std::push_heap` builds a max heap, so compare the other way round */
+    struct later
+    {
+        auto operator()(entry const& lhs, entry const& rhs) const noexcept
+                -> bool
+        {
+            return lhs.deadline != rhs.deadline
+                    ? lhs.deadline > rhs.deadline
+                    : lhs.sequence > rhs.sequence;
+        }
+    };
+
+public:
+    deadline_queue()
+    {
+        m_heap.reserve(initial_capacity);
+    }
+
+    auto push(boost::fibers::context * ctx) noexcept -> void
+    {
+        auto deadline = static_cast<thread_locked_props *>(
+                ctx->get_properties())->deadline();
+        if ((time_point::max)() == deadline) {
+            m_fifo.push_back(*ctx);
+        } else {
+            m_heap.push_back(entry{deadline, m_sequence++, ctx});
+            std::push_heap(m_heap.begin(), m_heap.end(), later{});
+        }
+    }
+
+    auto pop() noexcept -> boost::fibers::context *
+    {
+        if (!m_fifo.empty() && (m_heap.empty() || m_passed >= Share)) {
+            auto ctx = &m_fifo.front();
+            m_fifo.pop_front();
+            m_passed = 0;
+            return ctx;
+        }
+        if (m_heap.empty()) {
+            return nullptr;
+        }
+
+        std::pop_heap(m_heap.begin(), m_heap.end(), later{});
+        auto next = m_heap.back();
+        m_heap.pop_back();
+        if (!m_fifo.empty()) {
+            ++m_passed;
+        }
+        if (next.deadline < std::chrono::steady_clock::now() &&
+                static_cast<thread_locked_props *>(
+                        next.ctx->get_properties())->mark_deadline_missed()) {
+            m_misses.fetch_add(1, std::memory_order_relaxed);
+        }
+        return next.ctx;
+    }
+
+    auto empty() const noexcept -> bool
+    {
+        return m_heap.empty() && m_fifo.empty();
+    }
+
+    /*  Only reached for fibers in the FIFO, which may now have a deadline */
+    auto requeue(boost::fibers::context * ctx) noexcept -> void
+    {
+        ctx->ready_unlink();
+        push(ctx);
+    }
+
+    auto extract(boost::fibers::context::id id) noexcept
+            -> boost::fibers::context *
+    {
+        auto found = std::find_if(m_heap.begin(), m_heap.end(),
+                [id](auto const& entry){ return entry.ctx->get_id() == id; });
+        if (found == m_heap.end()) {
+            return extract_fiber(m_fifo, id);
+        }
+        auto ctx = found->ctx;
+        m_heap.erase(found);
+        std::make_heap(m_heap.begin(), m_heap.end(), later{});
+        return ctx;
+    }
+
+    /*  Fibers that ran later than their deadline; readable from any thread */
+    auto deadline_misses() const noexcept -> std::uint64_t
+    {
+        return m_misses.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr std::size_t initial_capacity = 256;
+
+    std::vector<entry>          m_heap{};
+    queue_t                     m_fifo{};
+    std::uint64_t               m_sequence{0};
+    std::size_t                 m_passed{0};
+    std::atomic<std::uint64_t>  m_misses{0};
+};
+
+
+
+/*  Deficit round robin between groups of fibers, by the time they actually
+    spend running. Each of `Groups` groups has a FIFO; a fiber's group property
+    is taken modulo `Groups`, so group 0 is the default and also holds the
+    dispatcher. When a group's turn comes round it earns `QuantumUs`
+    microseconds times its weight, and is served until its fibers have used the
+    time up. A group that runs dry loses any credit it has left, but keeps
+    its debt, so a fiber that overruns pays for it whether or not it has
+    company in its group.
+
+    A fiber runs from one `pop` to the next, so the time between them is
+    charged to the group of the fiber last popped. An empty `pop` means the
+    scheduler is going idle, and stops the clock.
+
+    A fiber that yields is only queued again once the next fiber has been
+    switched to, so a group whose one fiber is yielding looks empty, and two
+    groups of one fiber each would simply take turns, however long each
+    runs. The yielding fiber's group is therefore counted as ready, and when
+    it is the one to be served, the dispatcher is run in between, for the
+    fiber to be queued and picked from there. */
+template <std::size_t Groups = 16, std::size_t QuantumUs = 100>
+class weighted_fair_queue
+{
+    static_assert(Groups > 0, "at least one group is needed");
+
+    using queue_t = boost::fibers::scheduler::ready_queue_type;
+    using clock_t = std::chrono::steady_clock;
+
+    struct group_state
+    {
+        queue_t                     fibers{};
+        std::int64_t                deficit{0};
+        unsigned                    weight{1};
+        std::atomic<std::uint64_t>  run_time{0};
+    };
+
+public:
+    auto push(boost::fibers::context * ctx) noexcept -> void
+    {
+        auto & props = *static_cast<thread_locked_props *>(
+                ctx->get_properties());
+        auto & group = m_groups[props.group() % Groups];
+        group.weight = props.group_weight();
+        group.fibers.push_back(*ctx);
+        ++m_size;
+        if (ctx->is_context(boost::fibers::type::dispatcher_context)) {
+            m_dispatcher = ctx;
+        }
+    }
+
+    auto pop() noexcept -> boost::fibers::context *
+    {
+        auto now = clock_t::now();
+        charge(now);
+        if (0 == m_size) {
+            return nullptr;
+        }
+
+        /*  One pass round the groups, a ready group earning its quantum as
+            its turn ends. A group deep in debt, after a fiber ran far past
+            its quantum, can still have nothing to spend after that; rather
+            than going round again until some group does, each ready group
+            is given what it would have earned by then, and the pass is made
+            once more, which serves the first group to have credit. */
+        auto yielding = yielding_group();
+        auto ready = [this, yielding](std::size_t index){
+            return !m_groups[index].fibers.empty() || index == yielding;
+        };
+        for (;;) {
+            auto passes = (std::numeric_limits<std::int64_t>::max)();
+            for (auto step = std::size_t{0}; step != Groups; ++step) {
+                auto & group = m_groups[m_current];
+                if (!ready(m_current)) {
+                    /*  No banking credit while idle, but no writing off
+                        debt either, or a fiber that blocks after overrunning
+                        would never pay for it */
+                    group.deficit = (std::min)(group.deficit,
+                            std::int64_t{0});
+                }
+                else if (group.deficit > 0) {
+                    return serve(now);
+                }
+                else {
+                    auto earned = earning(group);
+                    group.deficit += earned;
+                    passes = (std::min)(passes, -group.deficit / earned + 1);
+                }
+                m_current = (m_current + 1) % Groups;
+            }
+            for (auto index = std::size_t{0}; index != Groups; ++index) {
+                if (ready(index)) {
+                    m_groups[index].deficit +=
+                            passes * earning(m_groups[index]);
+                }
+            }
+        }
+    }
+
+    auto empty() const noexcept -> bool
+    {
+        return 0 == m_size;
+    }
+
+    /*  The fiber may have changed group */
+    auto requeue(boost::fibers::context * ctx) noexcept -> void
+    {
+        ctx->ready_unlink();
+        --m_size;
+        push(ctx);
+    }
+
+    auto extract(boost::fibers::context::id id) noexcept
+            -> boost::fibers::context *
+    {
+        for (auto & group : m_groups) {
+            if (auto ctx = extract_fiber(group.fibers, id)) {
+                --m_size;
+                return ctx;
+            }
+        }
+        return nullptr;
+    }
+
+    /*  Total time fibers of `group` have spent running on this scheduler;
+        readable from any thread */
+    auto run_time(std::size_t group) const noexcept -> std::chrono::nanoseconds
+    {
+        return std::chrono::nanoseconds{static_cast<std::int64_t>(
+                m_groups[group % Groups].run_time.load(
+                        std::memory_order_relaxed))};
+    }
+
+private:
+    static constexpr auto quantum = std::chrono::nanoseconds{
+            std::chrono::microseconds{QuantumUs}};
+    static constexpr auto not_running = Groups;
+
+    static auto earning(group_state const& group) noexcept -> std::int64_t
+    {
+        return static_cast<std::int64_t>(quantum.count()) * group.weight;
+    }
+
+    /*  Group of the fiber switching away, if it is yielding rather than
+        waiting on something, and will be queued again straight after */
+    auto yielding_group() const noexcept -> std::size_t
+    {
+        auto active = boost::fibers::context::active();
+        if (active->is_context(boost::fibers::type::dispatcher_context) ||
+                active->ready_is_linked() || active->wait_is_linked() ||
+                active->sleep_is_linked() || active->terminated_is_linked() ||
+                nullptr == active->get_properties()) {
+            return not_running;
+        }
+        return static_cast<thread_locked_props *>(
+                active->get_properties())->group() % Groups;
+    }
+
+    /*  Serves the current group. If it is only ready because its fiber is
+        yielding, the dispatcher runs instead, if it is waiting; otherwise
+        the next group that has a fiber queued is served. */
+    auto serve(clock_t::time_point now) noexcept -> boost::fibers::context *
+    {
+        if (!m_groups[m_current].fibers.empty()) {
+            return take(now);
+        }
+        if (nullptr != m_dispatcher && m_dispatcher->ready_is_linked()) {
+            auto ctx = std::exchange(m_dispatcher, nullptr);
+            ctx->ready_unlink();
+            --m_size;
+            m_running = static_cast<thread_locked_props *>(
+                    ctx->get_properties())->group() % Groups;
+            m_started = now;
+            return ctx;
+        }
+        while (m_groups[m_current].fibers.empty()) {
+            m_current = (m_current + 1) % Groups;
+        }
+        return take(now);
+    }
+
+    /*  Starts the front fiber of the current group running */
+    auto take(clock_t::time_point now) noexcept -> boost::fibers::context *
+    {
+        auto & group = m_groups[m_current];
+        auto ctx = &group.fibers.front();
+        group.fibers.pop_front();
+        --m_size;
+        m_running = m_current;
+        m_started = now;
+        return ctx;
+    }
+
+    /*  Charges the time since the last fiber was picked to its group */
+    auto charge(clock_t::time_point now) noexcept -> void
+    {
+        if (not_running == m_running) {
+            return;
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                now - m_started).count();
+        auto & group = m_groups[m_running];
+        group.deficit -= elapsed;
+        group.run_time.fetch_add(static_cast<std::uint64_t>(elapsed),
+                std::memory_order_relaxed);
+        m_running = not_running;
+    }
+
+    std::array<group_state, Groups> m_groups{};
+    std::size_t                     m_size{0};
+    std::size_t                     m_current{0};
+    std::size_t                     m_running{not_running};
+    clock_t::time_point             m_started{};
+    /*  Set each time it is queued */
+    boost::fibers::context *        m_dispatcher{nullptr};
+};
+
+
+
+/*  Holds the fiber most recently woken by another fiber on the same thread in
+    a single slot, which is picked before anything in `Queue`. When fiber A
+    wakes B, e.g. by sending on a channel, B runs next while the data A left
+    for it is still in cache, instead of waiting behind the whole queue. A
+    fiber displaced from the slot goes to the back of `Queue`, and after
+    `Budget` consecutive picks from the slot, `Queue` is served, so a chain of
+    fibers waking each other cannot starve the rest. A fiber that yields is
+    queued as usual. */
+template <typename Queue = fifo_queue, std::size_t Budget = 8>
+class lifo_slot
+{
+public:
+    auto push(boost::fibers::context * ctx) noexcept -> void
+    {
+        m_queue.push(ctx);
+    }
+
+    auto wake(boost::fibers::context * ctx) noexcept -> void
+    {
+        if (nullptr != m_slot) {
+            m_queue.push(m_slot);
+        }
+        m_slot = ctx;
+    }
+
+    auto pop() noexcept -> boost::fibers::context *
+    {
+        if (nullptr != m_slot) {
+            auto ctx = std::exchange(m_slot, nullptr);
+            if (m_run < Budget) {
+                ++m_run;
+                return ctx;
+            }
+            m_queue.push(ctx);
+        }
+        m_run = 0;
+        return m_queue.pop();
+    }
+
+    auto empty() const noexcept -> bool
+    {
+        return nullptr == m_slot && m_queue.empty();
+    }
+
+    /*  A fiber in the slot is about to run whatever its properties are */
+    auto requeue(boost::fibers::context * ctx) noexcept -> void
+    {
+        if (ctx != m_slot) {
+            m_queue.requeue(ctx);
+        }
+    }
+
+    auto extract(boost::fibers::context::id id) noexcept
+            -> boost::fibers::context *
+    {
+        if (nullptr != m_slot && m_slot->get_id() == id) {
+            return std::exchange(m_slot, nullptr);
+        }
+        return m_queue.extract(id);
+    }
+
+    auto queue() const noexcept -> Queue const&
+    {
+        return m_queue;
+    }
+
+private:
+    Queue                       m_queue{};
+    boost::fibers::context *    m_slot{nullptr};
+    std::size_t                 m_run{0};
+};
+
+
+
+/*  Idle ---------------------------------------------------------------------*/
+
+/*  Blocks the thread on a condition variable until notified or until the next
+    sleeping fiber is due. */
+class condition_idle
+{
+public:
+    auto suspend_until(std::chrono::steady_clock::time_point const& time_point)
+        noexcept -> void
+    {
+        auto lock = std::unique_lock<std::mutex>{ m_mutex };
+        if ( (std::chrono::steady_clock::time_point::max)() == time_point) {
+            m_condition.wait( lock, [this](){ return m_flag; });
+        } else {
+            m_condition.wait_until(lock, time_point, [this](){ return m_flag; });
+        }
+        m_flag = false;
+    }
+
+    auto notify() noexcept -> void
+    {
+        auto lock = std::unique_lock<std::mutex>{ m_mutex };
+        m_flag = true;
+        lock.unlock();
+        m_condition.notify_all();
+    }
+
+private:
+    std::mutex              m_mutex{};
+    std::condition_variable m_condition{};
+    bool                    m_flag{false};
+};
+
+
+
+/*  Never blocks; the thread keeps yielding to the OS until notified or until
+    the next sleeping fiber is due. Burns a core, but a newly accepted fiber is
+    picked up without waiting for the thread to be woken. */
+class spin_idle
+{
+public:
+    auto suspend_until(std::chrono::steady_clock::time_point const& time_point)
+        noexcept -> void
+    {
+        while (!m_flag.exchange(false, std::memory_order_acquire)) {
+            if (std::chrono::steady_clock::now() >= time_point) {
+                return;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    auto notify() noexcept -> void
+    {
+        m_flag.store(true, std::memory_order_release);
+    }
+
+private:
+    std::atomic<bool> m_flag{false};
+};
+
+
+
+/*  Stats --------------------------------------------------------------------*/
+
+/*  Records nothing. */
+struct no_stats
+{
+    auto on_awakened() noexcept -> void {}
+    auto on_placed() noexcept -> void {}
+    auto on_accepted() noexcept -> void {}
+    auto on_picked() noexcept -> void {}
+    auto on_idle() noexcept -> void {}
+};
+
+
+
+/*  Counts scheduling events for the scheduler that owns it. `accepted` is
+    incremented by the placing thread, hence the atomics. */
+struct counting_stats
+{
+    auto on_awakened() noexcept -> void { increment(awakened); }
+    auto on_placed() noexcept -> void { increment(placed); }
+    auto on_accepted() noexcept -> void { increment(accepted); }
+    auto on_picked() noexcept -> void { increment(picked); }
+    auto on_idle() noexcept -> void { increment(idle); }
+
+    std::atomic<std::uint64_t> awakened{0};
+    std::atomic<std::uint64_t> placed{0};
+    std::atomic<std::uint64_t> picked{0};
+    std::atomic<std::uint64_t> idle{0};
+    /*  Counted by the placing thread, so kept off the owner's cache line */
+    alignas(utility::cache_line_size)
+    std::atomic<std::uint64_t> accepted{0};
+
+protected:
+    static auto increment(std::atomic<std::uint64_t> & counter) noexcept -> void
+    {
+        counter.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+
+
+/*  As `counting_stats`, and also has the scheduler keep per fiber accounting
+    in `thread_locked_props`: resumes, time spent running and time spent
+    waiting to run. This costs a cycle counter read whenever a fiber is made
+    ready and whenever the scheduler switches. */
+struct accounting_stats : counting_stats
+{
+    static constexpr bool accounts_fibers = true;
+};
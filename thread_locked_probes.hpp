@@ -0,0 +1,86 @@
+
+//      Copyright CommitThis 2020
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+
+/*  USDT probes on the scheduler's hot paths, for tracing with bpftrace or
+    SystemTap without rebuilding:
+
+        bpftrace -e 'usdt:./libtlfiber.so:tlfiber:pick_next { @[arg1] = count(); }'
+
+    The probes end up wherever the scheduler is instantiated; the library for
+    `thread_locked_scheduler`, and the executable for other combinations of
+    policies.
+
+    Every probe carries the same three arguments: the fiber (its context's
+    address, which is also what `fiber::id` prints, or 0), the index of the
+    scheduler (-1 for a main scheduler that does not take part in the work)
+    and the depth of the ready queue.
+
+        awakened        a fiber has been made ready
+        accept          a new fiber has been handed to this scheduler
+        pick_next       a fiber is about to be resumed (0 if none is ready)
+        suspend_until   the scheduler is going idle
+        notify          the scheduler is being woken up
+
+    Each probe has a semaphore, which the tracer raises while it is attached,
+    so a probe that nothing is attached to costs a load and a branch that is
+    not taken, and its arguments are not evaluated. Without `<sys/sdt.h>`
+    (systemtap-sdt-dev on Debian), or with `TLFIBER_NO_PROBES` defined, the
+    probes are not compiled in at all. */
+
+#if !defined(TLFIBER_NO_PROBES) && defined(__has_include)
+#  if __has_include(<sys/sdt.h>)
+/*  `<sys/sdt.h>` only looks at `_SDT_HAS_SEMAPHORES` while it is being
+    included, so it is defined for as long as that takes and no longer;
+    anything including `<sys/sdt.h>` after this header sees it as it would
+    have done anyway. */
+#    if !defined(_SYS_SDT_H) && !defined(_SDT_HAS_SEMAPHORES)
+#      define _SDT_HAS_SEMAPHORES 1
+#      include <sys/sdt.h>
+#      undef _SDT_HAS_SEMAPHORES
+#      define TLFIBER_PROBE_SEMAPHORES 1
+#    else
+#      include <sys/sdt.h>
+#      if defined(_SDT_HAS_SEMAPHORES)
+#        define TLFIBER_PROBE_SEMAPHORES 1
+#      endif
+#    endif
+#    if defined(TLFIBER_PROBE_SEMAPHORES)
+/*  The notes refer to the semaphores by their unmangled names. They are
+    weak, so every translation unit can define them, and hidden, so that
+    each module instantiating the scheduler gets its own, next to its own
+    notes. */
+#      define TLFIBER_SEMAPHORE(name) \
+        __extension__ unsigned short tlfiber_##name##_semaphore \
+            __attribute__((weak, visibility("hidden"), section(".probes"))) = 0
+extern "C" {
+TLFIBER_SEMAPHORE(awakened);
+TLFIBER_SEMAPHORE(accept);
+TLFIBER_SEMAPHORE(pick_next);
+TLFIBER_SEMAPHORE(suspend_until);
+TLFIBER_SEMAPHORE(notify);
+}
+#      undef TLFIBER_SEMAPHORE
+#      define TLFIBER_PROBE(name, fiber, scheduler, depth) \
+        do { \
+            if (__builtin_expect(0 != tlfiber_##name##_semaphore, 0)) { \
+                STAP_PROBE3(tlfiber, name, fiber, scheduler, depth); \
+            } \
+        } while (false)
+#    else
+/*  `<sys/sdt.h>` was included before without semaphores */
+#      define TLFIBER_PROBE(name, fiber, scheduler, depth) \
+        STAP_PROBE3(tlfiber, name, fiber, scheduler, depth)
+#    endif
+#  endif
+#endif
+
+#if !defined(TLFIBER_PROBE)
+#  define TLFIBER_PROBE(name, fiber, scheduler, depth) \
+        do {} while (false)
+#endif
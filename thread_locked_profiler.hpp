@@ -0,0 +1,368 @@
+
+//      Copyright CommitThis 2020
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "thread_locked_scheduler.hpp"
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+
+/*  A sampling profiler that knows which fiber it caught.
+
+    An ordinary profiler sees threads, and every fiber pinned to a thread is
+    lumped in together. This one interrupts each scheduler's thread `rate`
+    times a second with `signal`; the handler takes the stack along with the
+    fiber the scheduler last resumed, and writes them to a ring belonging to
+    that thread. The profiler's own thread empties the rings as it goes, and
+    `write_folded` gives the result as folded stacks, one line per distinct
+    stack prefixed with the fiber's name, ready for `flamegraph.pl`:
+
+        cruncher;make_fcontext;[app];[app];crunch(int) 149
+
+    Samples landing on an idle scheduler are dropped, and those taken while
+    the scheduler itself is running, between fibers, are put down to
+    `(scheduler)`. Fibers without a name are `(unnamed)`. The handler only
+    reads the copy of the name the properties keep for it (see
+    `thread_locked_props::short_name`), so long names are cut short.
+
+    Construct it once every scheduler in the pool is up. Only one profiler
+    should exist at a time, as the signal handler is shared. Function names
+    need the executable to be linked with `-rdynamic`.
+*/
+template <typename Scheduler = thread_locked_scheduler>
+class fiber_profiler
+{
+public:
+    explicit fiber_profiler(unsigned rate = 99, int signal = SIGPROF)
+        : m_period{std::chrono::nanoseconds{std::chrono::seconds{1}} / rate}
+        , m_signal{signal}
+        , m_sent{s_taken.load(std::memory_order_relaxed)}
+        , m_rings(Scheduler::scheduler_count())
+        , m_mutex{}
+        , m_condition{}
+        , m_stopping{false}
+        , m_stacks{}
+        , m_samples{0}
+        , m_thread{}
+    {
+        for (auto & ring : m_rings) {
+            ring = std::make_unique<sample_ring>();
+        }
+
+        /*  The first call to `backtrace` loads the unwinder, which is not
+            something to be doing inside a signal handler */
+        void * frame = nullptr;
+        ::backtrace(&frame, 1);
+
+        s_active.store(this, std::memory_order_release);
+        struct sigaction action{};
+        action.sa_handler = &fiber_profiler::on_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        ::sigaction(m_signal, &action, &m_previous);
+
+        m_thread = std::thread{[this](){ run(); }};
+    }
+
+    ~fiber_profiler()
+    {
+        stop();
+    }
+
+    fiber_profiler(fiber_profiler const&) = delete;
+    auto operator=(fiber_profiler const&) -> fiber_profiler & = delete;
+
+
+    /*  Stops sampling; what has been collected stays available */
+    auto stop() -> void
+    {
+        {
+            auto lock = std::lock_guard<std::mutex>{ m_mutex };
+            if (m_stopping) {
+                return;
+            }
+            m_stopping = true;
+        }
+        m_condition.notify_all();
+        m_thread.join();
+        /*  Signals may still be pending on threads slow to take them, and
+            the default action for SIGPROF ends the process. From here the
+            handler leaves the profiler alone, and once every signal sent has
+            been taken the previous disposition can go back; any that never
+            turn up find the handler still installed. */
+        s_active.store(nullptr, std::memory_order_release);
+        if (signals_taken(std::chrono::seconds{1})) {
+            ::sigaction(m_signal, &m_previous, nullptr);
+        }
+        drain();
+    }
+
+    /*  Samples collected so far, and those lost to a full ring */
+    auto sample_count() const noexcept -> std::uint64_t
+    {
+        return m_samples.load(std::memory_order_relaxed);
+    }
+    auto dropped_count() const noexcept -> std::uint64_t
+    {
+        auto dropped = std::uint64_t{0};
+        for (auto const& ring : m_rings) {
+            dropped += ring->dropped.load(std::memory_order_relaxed);
+        }
+        return dropped;
+    }
+
+    /*  Writes the samples so far as folded stacks, outermost frame first */
+    auto write_folded(std::ostream & out) -> void
+    {
+        drain();
+        auto lock = std::lock_guard<std::mutex>{ m_mutex };
+        /*  Samples at different places in the same function fold into
+            one line once the addresses have been turned into names */
+        auto names = std::map<void *, std::string>{};
+        auto folded = std::map<std::string, std::uint64_t>{};
+        for (auto const& [key, count] : m_stacks) {
+            auto const& [type, frames] = key;
+            auto line = type;
+            for (auto frame = frames.rbegin(); frame != frames.rend(); ++frame) {
+                auto found = names.find(*frame);
+                if (found == names.end()) {
+                    found = names.emplace(*frame, symbol_name(*frame)).first;
+                }
+                line += ';';
+                line += found->second;
+            }
+            folded[line] += count;
+        }
+        for (auto const& [line, count] : folded) {
+            out << line << ' ' << count << '\n';
+        }
+    }
+
+private:
+    static constexpr std::size_t max_frames = 48;
+    static constexpr std::size_t ring_size = 1024;
+    static constexpr std::size_t max_name =
+            thread_locked_props::short_name_size + 1;
+
+    struct sample
+    {
+        std::array<void *, max_frames>  frames;
+        int                             depth;
+        std::array<char, max_name>      type;
+    };
+
+    /*  Written by the handler on the scheduler's thread, read by the
+        profiler's thread */
+    struct sample_ring
+    {
+        std::array<sample, ring_size>   samples{};
+        alignas(utility::cache_line_size)
+        std::atomic<std::size_t>        head{0};
+        alignas(utility::cache_line_size)
+        std::atomic<std::size_t>        tail{0};
+        std::atomic<std::uint64_t>      dropped{0};
+    };
+
+    using stack_key = std::pair<std::string, std::vector<void *>>;
+
+    auto run() -> void
+    {
+        auto const& schedulers = Scheduler::schedulers();
+        auto lock = utility::make_unique_lock(m_mutex);
+        while (!m_condition.wait_for(lock, m_period,
+                [this](){ return m_stopping; })) {
+            lock.unlock();
+            for (auto ii = std::size_t{0}; ii != std::size(m_rings); ++ii) {
+                if (0 == ::pthread_kill(schedulers[ii]->native_handle(),
+                        m_signal)) {
+                    ++m_sent;
+                }
+            }
+            drain();
+            lock.lock();
+        }
+    }
+
+    /*  Moves samples out of the rings and into the counts */
+    auto drain() -> void
+    {
+        auto lock = std::lock_guard<std::mutex>{ m_mutex };
+        for (auto & ring : m_rings) {
+            auto tail = ring->tail.load(std::memory_order_relaxed);
+            auto head = ring->head.load(std::memory_order_acquire);
+            for (; tail != head; ++tail) {
+                auto const& taken = ring->samples[tail % ring_size];
+                auto key = stack_key{taken.type.data(), std::vector<void *>(
+                        taken.frames.begin(), taken.frames.begin() + taken.depth)};
+                ++m_stacks[std::move(key)];
+                m_samples.fetch_add(1, std::memory_order_relaxed);
+            }
+            ring->tail.store(tail, std::memory_order_release);
+        }
+    }
+
+    /*  Whether every signal sent has been handled, waiting up to `timeout`
+        for those that have not */
+    auto signals_taken(std::chrono::nanoseconds timeout) const -> bool
+    {
+        using namespace std::chrono_literals;
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (s_taken.load(std::memory_order_acquire) != m_sent) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                return false;
+            }
+            std::this_thread::sleep_for(1ms);
+        }
+        return true;
+    }
+
+    static auto on_signal(int) -> void
+    {
+        auto saved = errno;
+        auto profiler = s_active.load(std::memory_order_acquire);
+        if (nullptr != profiler) {
+            profiler->take_sample();
+        }
+        s_taken.fetch_add(1, std::memory_order_release);
+        errno = saved;
+    }
+
+    /*  Runs in the signal handler, so only looks things up. Never inlined,
+        so that the frames to skip are always the same. */
+    BOOST_NOINLINE auto take_sample() noexcept -> void
+    {
+        auto const& schedulers = Scheduler::schedulers();
+        auto self = ::pthread_self();
+        auto index = std::size(m_rings);
+        for (auto ii = std::size_t{0}; ii != std::size(m_rings); ++ii) {
+            if (::pthread_equal(self, schedulers[ii]->native_handle())) {
+                index = ii;
+                break;
+            }
+        }
+        if (index == std::size(m_rings)) {
+            return;
+        }
+
+        auto const& activity = schedulers[index]->activity();
+        if (activity.suspended.load(std::memory_order_relaxed)) {
+            return;
+        }
+        auto & ring = *m_rings[index];
+        auto head = ring.head.load(std::memory_order_relaxed);
+        if (head - ring.tail.load(std::memory_order_acquire) == ring_size) {
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        auto & taken = ring.samples[head % ring_size];
+        /*  The first frames are this function, the handler and the signal
+            trampoline, leaving the interrupted function on top */
+        constexpr auto skipped = 3;
+        void * frames[max_frames + skipped];
+        auto depth = ::backtrace(frames, max_frames + skipped);
+        taken.depth = std::max(depth - skipped, 0);
+        std::copy(frames + skipped, frames + skipped + taken.depth,
+                taken.frames.begin());
+        copy_type(taken.type, activity.running.load(std::memory_order_relaxed));
+
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+
+    static auto copy_type(std::array<char, max_name> & type, context * fiber)
+            noexcept -> void
+    {
+        auto name = "(scheduler)";
+        auto length = std::strlen(name);
+        if (nullptr != fiber) {
+            auto props = static_cast<thread_locked_props *>(
+                    fiber->get_properties());
+            auto [short_name, short_length] = nullptr != props
+                    ? props->short_name()
+                    : std::pair<char const *, std::size_t>{nullptr, 0};
+            if (0 != short_length) {
+                name = short_name;
+                length = short_length;
+            } else {
+                name = "(unnamed)";
+                length = std::strlen(name);
+            }
+        }
+        length = std::min(length, max_name - 1);
+        std::copy(name, name + length, type.begin());
+        type[length] = '\0';
+    }
+
+    /*  Demangled function name; failing that, the file it is in, and
+        failing that, the address */
+    static auto symbol_name(void * address) -> std::string
+    {
+        auto info = Dl_info{};
+        auto found = 0 != ::dladdr(address, &info);
+        if (found && nullptr != info.dli_sname) {
+            auto status = 0;
+            auto demangled = std::unique_ptr<char, decltype(&std::free)>{
+                    abi::__cxa_demangle(info.dli_sname, nullptr, nullptr,
+                            &status), &std::free};
+            auto name = std::string{0 == status ? demangled.get()
+                                                : info.dli_sname};
+            /*  Semicolons separate the frames */
+            std::replace(name.begin(), name.end(), ';', ':');
+            return name;
+        }
+        if (found && nullptr != info.dli_fname) {
+            auto file = std::string{info.dli_fname};
+            return "[" + file.substr(file.find_last_of('/') + 1) + "]";
+        }
+        auto text = std::ostringstream{};
+        text << address;
+        return text.str();
+    }
+
+    inline static std::atomic<fiber_profiler *> s_active{nullptr};
+    /*  Signals handled, to be matched against `m_sent` */
+    inline static std::atomic<std::uint64_t> s_taken{0};
+
+    std::chrono::nanoseconds    m_period;
+    int                         m_signal;
+    struct sigaction            m_previous{};
+    /*  Signals sent, counting on from those taken by earlier profilers; only
+        touched by the profiler's thread until it is joined */
+    std::uint64_t               m_sent;
+    std::vector<std::unique_ptr<sample_ring>> m_rings;
+    std::mutex                  m_mutex;
+    std::condition_variable     m_condition;
+    bool                        m_stopping;
+    std::map<stack_key, std::uint64_t> m_stacks;
+    std::atomic<std::uint64_t>  m_samples;
+    std::thread                 m_thread;
+};
@@ -0,0 +1,381 @@
+
+//      Copyright CommitThis 2020
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/context.hpp>
+#include <boost/fiber/properties.hpp>
+#include <boost/intrusive/list.hpp>
+
+
+
+/*  Load on a single scheduler, kept up to date by the scheduler and readable
+    from any thread, e.g. for shedding load before it reaches the pool. */
+struct shard_gauges
+{
+    /*  Fibers pinned to the scheduler that have not yet been destroyed */
+    std::atomic<std::size_t> live{0};
+    /*  Fibers waiting in the scheduler's ready queue */
+    std::atomic<std::size_t> ready{0};
+
+    /*  Spawning fibers suspended until a fiber here ends, as the scheduler
+        is at its admission limit (see `overload_policy::block`). They may be
+        on any thread, so wait on a fiber condition variable guarded by an
+        ordinary mutex, which is only ever held for a moment. */
+    std::atomic<std::size_t>                blocked{0};
+    std::mutex                              blocked_mutex{};
+    boost::fibers::condition_variable_any   room{};
+
+    /*  One fewer live fiber, which makes room for a blocked spawn */
+    auto release() noexcept -> void
+    {
+        live.fetch_sub(1, std::memory_order_relaxed);
+        wake_blocked();
+    }
+
+    /*  Wakes every blocked spawn to check for room again. Fenced against
+        the spawn's count of itself, so that either it sees the room made
+        or it is seen to be waiting. */
+    auto wake_blocked() noexcept -> void
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (0 != blocked.load(std::memory_order_relaxed)) {
+            auto lock = std::lock_guard<std::mutex>{ blocked_mutex };
+            room.notify_all();
+        }
+    }
+};
+
+
+
+/*  Where a fiber's time has gone, in `utility::cycle_clock` ticks. Only kept
+    by schedulers whose stats policy asks for it (see `accounting_stats`),
+    and only touched by the thread the fiber is pinned to. */
+struct fiber_accounting
+{
+    /*  Times the fiber has been resumed */
+    std::uint64_t resumes{0};
+    /*  Time spent running */
+    std::uint64_t cpu_ticks{0};
+    /*  Time spent ready, waiting for the scheduler to get round to it */
+    std::uint64_t wait_ticks{0};
+    /*  When the fiber last became ready */
+    std::uint64_t ready_since{0};
+};
+
+/*  Accounting summed over a number of fibers */
+struct fiber_totals
+{
+    std::uint64_t fibers{0};
+    std::uint64_t resumes{0};
+    std::uint64_t cpu_ticks{0};
+    std::uint64_t wait_ticks{0};
+
+    auto add(fiber_accounting const& fiber) noexcept -> void
+    {
+        ++fibers;
+        resumes += fiber.resumes;
+        cpu_ticks += fiber.cpu_ticks;
+        wait_ticks += fiber.wait_ticks;
+    }
+
+    auto add(fiber_totals const& other) noexcept -> void
+    {
+        fibers += other.fibers;
+        resumes += other.resumes;
+        cpu_ticks += other.cpu_ticks;
+        wait_ticks += other.wait_ticks;
+    }
+};
+
+
+/*  Properties a fiber starts with, for `spawn` and `spawn_on`. Setting them
+    on the fiber after launching it only takes effect once the fiber has
+    been queued at least once with the defaults; these are in place before
+    it is queued at all. */
+struct spawn_options
+{
+    int             priority{0};
+    std::chrono::steady_clock::time_point deadline{
+            (std::chrono::steady_clock::time_point::max)()};
+    std::size_t     group{0};
+    unsigned        group_weight{1};
+};
+
+
+class thread_locked_props;
+struct shard_registry;
+
+/*  Links the properties of every live fiber on a scheduler together */
+using registry_hook = boost::intrusive::list_base_hook<
+        boost::intrusive::link_mode<boost::intrusive::normal_link>>;
+
+
+/*  Exposes custom property for each fiber; if the fiber has awakened for the
+    first time, `m_previously_awakened` will be false. The idea is that the
+    scheduler sets this after it's first been awakened */
+class thread_locked_props : public boost::fibers::fiber_properties
+        , public registry_hook
+{
+public:
+    thread_locked_props(boost::fibers::context * ctx)
+        : fiber_properties{ctx}
+        , m_previously_awakened(false)
+        , m_queued{false}
+        , m_home{nullptr}
+        , m_priority{0}
+        , m_deadline{(std::chrono::steady_clock::time_point::max)()}
+        , m_deadline_missed{false}
+        , m_group{0}
+        , m_group_weight{1}
+        , m_registry{nullptr}
+        , m_name{}
+        , m_short_name{}
+        , m_short_length{0}
+        , m_home_index{no_home}
+        , m_accounting{}
+    {
+    }
+
+    /*  The fiber no longer counts against its scheduler's live fibers */
+    inline ~thread_locked_props();
+
+    /*  The context the properties belong to */
+    auto context() const noexcept -> boost::fibers::context *
+    {
+        return ctx_;
+    }
+
+    auto was_previously_awakened() -> bool
+    {
+        return m_previously_awakened;
+    }
+    auto set_previously_awakened() -> void
+    {
+        if (!m_previously_awakened) {
+            m_previously_awakened = true;
+            /*  Notify isn't really needed as the change wouldn't be used */
+            notify();
+        }
+    }
+
+    /*  Gauges and index of the scheduler the fiber has been pinned to; the
+        scheduler has already counted the fiber as live. */
+    auto set_home(shard_gauges * home, std::size_t index) noexcept -> void
+    {
+        m_home = home;
+        m_home_index = index;
+    }
+    auto home_index() const noexcept -> std::size_t
+    {
+        return m_home_index;
+    }
+
+    static constexpr auto no_home = static_cast<std::size_t>(-1);
+
+    /*  Whether the fiber is waiting to run in its scheduler's queue, set by
+        the scheduler whenever it makes the fiber ready and cleared when it
+        picks it. Unlike `ready_is_linked`, it holds for a fiber the queue
+        policy keeps somewhere other than a Boost ready queue, such as a
+        deadline heap or the `lifo_slot`. */
+    auto is_queued() const noexcept -> bool
+    {
+        return m_queued;
+    }
+    auto set_queued(bool queued) noexcept -> void
+    {
+        m_queued = queued;
+    }
+
+    auto accounting() noexcept -> fiber_accounting &
+    {
+        return m_accounting;
+    }
+    auto accounting() const noexcept -> fiber_accounting const&
+    {
+        return m_accounting;
+    }
+
+    /*  Before the fiber is first queued, so there is nobody to tell */
+    auto apply(spawn_options const& options) noexcept -> void
+    {
+        m_priority.store(options.priority, std::memory_order_relaxed);
+        m_deadline.store(options.deadline, std::memory_order_relaxed);
+        m_group.store(options.group, std::memory_order_relaxed);
+        m_group_weight.store((std::max)(options.group_weight, 1u),
+                std::memory_order_relaxed);
+    }
+
+    /*  Higher runs sooner, for queues that take notice of it.
+
+        The scheduling properties may be set from any thread. Set from the
+        thread the fiber is pinned to, a ready fiber is moved within its
+        queue straight away; from anywhere else, which includes the thread
+        that has just launched the fiber, the change takes effect the next
+        time the fiber is queued. To have a fiber start out with them, pass
+        them to `spawn` in a `spawn_options`. */
+    auto priority() const noexcept -> int
+    {
+        return m_priority.load(std::memory_order_relaxed);
+    }
+    auto set_priority(int priority) noexcept -> void
+    {
+        if (priority != m_priority.exchange(priority,
+                std::memory_order_relaxed)) {
+            notify();
+        }
+    }
+
+    /*  When the fiber should have run by, for queues that take notice of it.
+        The default, `time_point::max()`, is no deadline at all. */
+    auto deadline() const noexcept -> std::chrono::steady_clock::time_point
+    {
+        return m_deadline.load(std::memory_order_relaxed);
+    }
+    auto set_deadline(std::chrono::steady_clock::time_point deadline) noexcept
+            -> void
+    {
+        if (deadline != m_deadline.exchange(deadline,
+                std::memory_order_relaxed)) {
+            m_deadline_missed.store(false, std::memory_order_relaxed);
+            notify();
+        }
+    }
+    /*  True only the first time it is called after the deadline was set, so
+        that a queue counts a missed deadline once, however many times the
+        fiber runs late against it */
+    auto mark_deadline_missed() noexcept -> bool
+    {
+        return !m_deadline_missed.exchange(true, std::memory_order_relaxed);
+    }
+
+    /*  Group the fiber's CPU time is shared out by, e.g. a tenant, and the
+        group's weight relative to the others, for queues that take notice of
+        them. The weight most recently given for a group applies to it, and
+        a weight of 0 is taken as 1, as a group that never earns any time
+        would never be served. */
+    auto group() const noexcept -> std::size_t
+    {
+        return m_group.load(std::memory_order_relaxed);
+    }
+    auto group_weight() const noexcept -> unsigned
+    {
+        return m_group_weight.load(std::memory_order_relaxed);
+    }
+    auto set_group(std::size_t group, unsigned weight = 1) noexcept -> void
+    {
+        weight = (std::max)(weight, 1u);
+        auto changed = group != m_group.exchange(group,
+                std::memory_order_relaxed);
+        changed |= weight != m_group_weight.exchange(weight,
+                std::memory_order_relaxed);
+        if (changed) {
+            notify();
+        }
+    }
+
+    /*  Shown in state dumps; like the other properties, set it from the
+        thread the fiber is pinned to */
+    auto name() const -> std::string const&
+    {
+        return m_name;
+    }
+    auto set_name(std::string name) -> void
+    {
+        m_name = std::move(name);
+        /*  A signal handler may interrupt this on the same thread; it sees
+            no name until the copy is complete */
+        m_short_length.store(0, std::memory_order_relaxed);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        auto length = (std::min)(m_name.size(), short_name_size);
+        std::copy_n(m_name.data(), length, m_short_name.data());
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        m_short_length.store(length, std::memory_order_relaxed);
+    }
+
+    /*  The first `short_name_size` characters of the name, in storage of the
+        fiber's own; unlike `name`, safe to read from a signal handler running
+        on the fiber's thread */
+    static constexpr std::size_t short_name_size = 32;
+    auto short_name() const noexcept -> std::pair<char const *, std::size_t>
+    {
+        auto length = m_short_length.load(std::memory_order_relaxed);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        return {m_short_name.data(), length};
+    }
+
+    /*  Adds the fiber to its scheduler's registry; done by the scheduler the
+        first time it resumes the fiber */
+    inline auto register_with(shard_registry & registry) -> void;
+    auto is_registered() const noexcept -> bool
+    {
+        return nullptr != m_registry;
+    }
+private:
+    bool            m_previously_awakened;
+    bool            m_queued;
+    shard_gauges *  m_home;
+    /*  Atomic, as they may be set from other threads; see `priority` */
+    std::atomic<int> m_priority;
+    std::atomic<std::chrono::steady_clock::time_point> m_deadline;
+    std::atomic<bool> m_deadline_missed;
+    std::atomic<std::size_t> m_group;
+    std::atomic<unsigned> m_group_weight;
+    shard_registry * m_registry;
+    std::string     m_name;
+    std::array<char, short_name_size> m_short_name;
+    std::atomic<std::size_t> m_short_length;
+    std::size_t     m_home_index;
+    fiber_accounting m_accounting;
+};
+
+
+
+/*  Every live fiber pinned to a scheduler. Fibers are added on the
+    scheduler's own thread, but may be destroyed on whichever thread drops
+    the last reference to them, hence the mutex. The accounting of fibers
+    that have been destroyed is kept, summed by name. */
+struct shard_registry
+{
+    std::mutex mutex{};
+    boost::intrusive::list<thread_locked_props,
+            boost::intrusive::constant_time_size<false>> fibers{};
+    std::unordered_map<std::string, fiber_totals> finished{};
+};
+
+
+auto thread_locked_props::register_with(shard_registry & registry) -> void
+{
+    auto lock = std::lock_guard<std::mutex>{ registry.mutex };
+    registry.fibers.push_back(*this);
+    m_registry = &registry;
+}
+
+thread_locked_props::~thread_locked_props()
+{
+    if (nullptr != m_home) {
+        m_home->release();
+    }
+    if (nullptr != m_registry) {
+        auto lock = std::lock_guard<std::mutex>{ m_registry->mutex };
+        m_registry->fibers.erase(m_registry->fibers.iterator_to(*this));
+        if (0 != m_accounting.resumes) {
+            m_registry->finished[m_name].add(m_accounting);
+        }
+    }
+}
@@ -14,10 +14,4 @@
 std::mutex utility::print_mtx{};
 
 
-std::mutex thread_locked_scheduler::s_mutex{};
-std::atomic<std::size_t> thread_locked_scheduler::s_current_scheduler{0};
-
-thread_locked_scheduler::scheduler_list_t
-        thread_locked_scheduler::s_schedulers{};
-
-
+template class basic_thread_locked_scheduler<>;
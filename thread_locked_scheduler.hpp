@@ -6,21 +6,46 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <condition_variable>
 #include <chrono>
-#include <deque>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <map>
 #include <mutex>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
+#include <boost/assert.hpp>
 #include <boost/config.hpp>
 
 #include <boost/fiber/algo/algorithm.hpp>
 #include <boost/fiber/context.hpp>
 #include <boost/fiber/detail/config.hpp>
+#include <boost/fiber/fiber.hpp>
+#include <boost/fiber/operations.hpp>
 #include <boost/fiber/scheduler.hpp>
 
 #include <boost/thread/barrier.hpp>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <pthread.h>
+#include <time.h>
+
+#include "thread_locked_policies.hpp"
+#include "thread_locked_probes.hpp"
+#include "thread_locked_props.hpp"
+
 
 using boost::fibers::context;
 using boost::fibers::scheduler;
@@ -38,6 +63,72 @@ inline auto make_unique_lock(Lockable & lockable) -> std::unique_lock<Lockable>
 
 extern std::mutex print_mtx;// = {};
 
+/*  A steady clock that is cheap enough to read on every context switch, at
+    the price of only ticking every few milliseconds. Falls back to
+    `steady_clock` where there is no coarse clock. */
+struct coarse_clock
+{
+    using duration = std::chrono::nanoseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point<coarse_clock>;
+    static constexpr bool is_steady = true;
+
+    static auto now() noexcept -> time_point
+    {
+#if defined(CLOCK_MONOTONIC_COARSE)
+        auto ts = timespec{};
+        ::clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return time_point{std::chrono::seconds{ts.tv_sec} +
+                std::chrono::nanoseconds{ts.tv_nsec}};
+#else
+        return time_point{std::chrono::duration_cast<duration>(
+                std::chrono::steady_clock::now().time_since_epoch())};
+#endif
+    }
+};
+
+/*  Counts processor cycles where there is a time stamp counter, and
+    nanoseconds elsewhere; cheaper than `steady_clock` for timing every
+    switch. */
+struct cycle_clock
+{
+    static auto now() noexcept -> std::uint64_t
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return static_cast<std::uint64_t>(
+                std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+
+    /*  Converts ticks to time; the first call measures the counter against
+        `steady_clock`, which takes a few milliseconds */
+    static auto to_duration(std::uint64_t ticks) -> std::chrono::nanoseconds
+    {
+        static auto const ticks_per_ns = calibrate();
+        return std::chrono::nanoseconds{
+                static_cast<std::chrono::nanoseconds::rep>(ticks / ticks_per_ns)};
+    }
+
+private:
+    static auto calibrate() -> double
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        auto start = std::chrono::steady_clock::now();
+        auto first = now();
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+        auto ticks = now() - first;
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return static_cast<double>(ticks) / std::chrono::duration_cast<
+                std::chrono::nanoseconds>(elapsed).count();
+#else
+        return 1.0;
+#endif
+    }
+};
+
 template <typename ... Args>
 inline auto locked_print(Args && ... args) -> void
 {
@@ -50,93 +141,265 @@ inline auto locked_print(Args && ... args) -> void
 
 
 
-/*  Exposes custom property for each fiber; if the fiber has awakened for the
-    first time, `m_previously_awakened` will be false. The idea is that the
-    scheduler sets this after it's first been awakened */
-class thread_locked_props : public boost::fibers::fiber_properties
+/*  Worker count for schedulers whose number of threads is only known at run
+    time. */
+inline constexpr std::size_t dynamic_workers = static_cast<std::size_t>(-1);
+
+
+/*  What `spawn` does when the scheduler a fiber would be placed on already has
+    as many live fibers as it is allowed */
+enum class overload_policy
+{
+    block,      /* the spawning fiber waits until a fiber ends */
+    redirect,   /* another scheduler with room is used instead */
+    reject      /* `admission_error` is thrown */
+};
+
+
+/*  Thrown by `spawn` when a fiber cannot be admitted to the pool */
+class admission_error : public std::runtime_error
 {
 public:
-    thread_locked_props(boost::fibers::context * ctx)
-        : fiber_properties{ctx}
-        , m_previously_awakened(false) 
-    {
-    }
-    auto was_previously_awakened() -> bool
-    {
-        return m_previously_awakened;
+    using std::runtime_error::runtime_error;
+};
+
+
+/*  Whether a stats policy asks for per fiber accounting */
+template <typename Stats, typename = void>
+struct stats_accounts_fibers : std::false_type {};
+
+template <typename Stats>
+struct stats_accounts_fibers<Stats, std::enable_if_t<Stats::accounts_fibers>>
+    : std::true_type {};
+
+
+/*  What a fiber was doing when its scheduler took a snapshot */
+enum class fiber_state
+{
+    running,    /* about to be resumed */
+    ready,      /* in the ready queue */
+    sleeping,   /* waiting for a timer, possibly as well as something else */
+    waiting     /* blocked on a fiber mutex, channel, join etc., or
+                   finished but not yet destroyed */
+};
+
+inline auto to_string(fiber_state state) noexcept -> char const *
+{
+    switch (state) {
+    case fiber_state::running:    return "running";
+    case fiber_state::ready:      return "ready";
+    case fiber_state::sleeping:   return "sleeping";
+    case fiber_state::waiting:    return "waiting";
     }
-    auto set_previously_awakened() -> void
+    return "unknown";
+}
+
+struct fiber_snapshot
+{
+    context::id     id;
+    std::string     name;
+    fiber_state     state;
+    fiber_accounting accounting;
+};
+
+/*  The fibers on a scheduler, as seen by the scheduler's own thread. Fibers
+    that have been placed but not yet resumed for the first time are only in
+    the gauges' ready count, not in `fibers`. */
+struct shard_snapshot
+{
+    std::size_t                 ready{0};
+    std::size_t                 live{0};
+    std::size_t                 sleeping{0};
+    std::vector<fiber_snapshot> fibers{};
+    /*  Accounting of live and destroyed fibers by name, if kept */
+    std::map<std::string, fiber_totals> totals{};
+};
+
+
+/*  What a scheduler is doing, published by its own thread on each switch so
+    that other threads can tell whether it is still making progress */
+struct shard_activity
+{
+    /*  Calls to `pick_next` so far */
+    std::atomic<std::uint64_t>  switches{0};
+    /*  When `pick_next` was last called, by `utility::coarse_clock` */
+    std::atomic<utility::coarse_clock::rep> last_switch{0};
+    /*  The fiber last resumed, if the scheduler is not suspended */
+    std::atomic<context *>      running{nullptr};
+    /*  Whether the thread is waiting in `suspend_until` */
+    std::atomic<bool>           suspended{false};
+
+    auto beat(std::uint64_t count, context * ctx) noexcept -> void
     {
-        if (!m_previously_awakened) {
-            m_previously_awakened = true;
-            /*  Notify isn't really needed as the change wouldn't be used */
-            notify();
-        }
+        switches.store(count, std::memory_order_relaxed);
+        last_switch.store(utility::coarse_clock::now().time_since_epoch()
+                .count(), std::memory_order_relaxed);
+        running.store(ctx, std::memory_order_relaxed);
     }
-private:
-    bool m_previously_awakened;
 };
 
 
+/*  Whether a queue policy handles fibers woken by another fiber on the same
+    thread differently to other ready fibers */
+template <typename Queue, typename = void>
+struct queue_has_wake : std::false_type {};
+
+template <typename Queue>
+struct queue_has_wake<Queue, std::void_t<decltype(
+        std::declval<Queue &>().wake(std::declval<context *>()))>>
+    : std::true_type {};
+
 
 /*  Thread locked scheduler. The aim of this class is to ensure that once a
     fiber has been started, it remains on the thread it was started from. This
     is achieved by giving the schedulers each their own ready queue, and 
     populating them in a round-robin fashion.
 
+    How fibers are placed, queued and waited for, and what is recorded while
+    doing so, are compile-time policies (see `thread_locked_policies.hpp`);
+    `thread_locked_scheduler` is the default combination.
+
+    If the number of worker schedulers is known when building, passing it as
+    `Workers` stores the scheduler list in a static array rather than on the
+    heap, and lets placement reduce the list size to a constant. `Workers`
+    counts every scheduler in the list, so includes the main scheduler when it
+    participates in the work.
+
     Because of the use of statics for the scheduler list, much like the other
     Boost schedulers, only one set of schedulers participating in the same
-    "pool of work" can exist.
+    "pool of work" can exist per combination of policies.
+
+    Each scheduler can be limited in the number of live fibers pinned to it;
+    see `set_admission_limit` and `spawn`.
 */
-class thread_locked_scheduler : public 
+template <typename Placement = local_round_robin_placement,
+          typename Queue = fifo_queue,
+          typename Idle = condition_idle,
+          typename Stats = no_stats,
+          std::size_t Workers = dynamic_workers>
+class basic_thread_locked_scheduler : public 
         algorithm_with_properties<thread_locked_props>
 {
-    using local_queue_t = scheduler::ready_queue_type;
-
     /*  an intrusive pointer is used because it scheduler objects maintain their
         reference counts, without having to use a shared_ptr. This makes 
         assignment from `this` possible. It is called intrusive because the
         reference count "intrudes" on the class's definition. */
-    using scheduler_list_t = std::vector<
-            boost::intrusive_ptr<thread_locked_scheduler>>;
+    using scheduler_ptr_t = boost::intrusive_ptr<basic_thread_locked_scheduler>;
+    using scheduler_list_t = std::conditional_t<Workers == dynamic_workers,
+            std::vector<scheduler_ptr_t>,
+            std::array<scheduler_ptr_t, Workers>>;
+    using inbox_t = boost::fibers::scheduler::ready_queue_type;
 
 public:
-    thread_locked_scheduler(std::size_t thread_count, bool main_scheduler = false)
+    using placement_type = Placement;
+    using queue_type = Queue;
+    using idle_type = Idle;
+    using stats_type = Stats;
+
+    static constexpr std::size_t worker_count = Workers;
+
+    /*  `main_weight` lets the main scheduler own a share of the pinned fibers
+        as well as dispatching them; 1.0 gives it as many as a worker, 0.5
+        half as many, and 0 (the default) none at all. Weights above 1.0 are
+        taken as 1.0, as the main scheduler never gets more than a worker's
+        share. It is ignored for the other schedulers. */
+    basic_thread_locked_scheduler(std::size_t thread_count,
+            bool main_scheduler = false, double main_weight = 0.0)
         : m_local_queue{}
-        , m_condition{}
-        , m_flag{false}
-        , m_suspend{false}
+        , m_placement{}
+        , m_stats{}
+        , m_main_credit{0.0}
+        , m_yield_target{}
+        , m_yielding{nullptr}
+        , m_picks{0}
+        , m_slice_start{0}
+        , m_current{nullptr}
+        , m_resumed_at{0}
+        , m_inbox_mutex{}
+        , m_inbox{}
+        , m_inbox_pending{false}
+        , m_snapshot_wanted{false}
+        , m_idle{}
+        , m_gauges{}
+        , m_registry{}
+        , m_snapshot{}
+        , m_snapshots_taken{0}
+        , m_activity{}
+        , m_index{no_index}
+        , m_thread{::pthread_self()}
     {
+        static_assert(alignof(basic_thread_locked_scheduler) ==
+                utility::cache_line_size);
+
         static boost::barrier barrier{static_cast<std::uint32_t>(thread_count)};
 
         /*  The first scheduler that is created is responsible for the creation
             of the vector of other schedulers. `call_once` safely manages this
-            across multiple threads. */
-        static std::once_flag flag;
-        std::call_once(flag, [thread_count](){
-            scheduler_list_t{thread_count - 1, nullptr}.swap(s_schedulers);
-        });
+            across multiple threads. Until the main scheduler turns up, nobody
+            knows whether it will take part, so there is room for it either
+            way. A fixed size list already exists. */
+        if constexpr (Workers == dynamic_workers) {
+            static std::once_flag flag;
+            std::call_once(flag, [thread_count](){
+                scheduler_list_t{thread_count, nullptr}.swap(s_schedulers);
+            });
+        } else {
+            BOOST_ASSERT_MSG(thread_count - 1 == Workers ||
+                    thread_count == Workers,
+                    "thread count does not match the fixed worker count");
+        }
 
-        /*  In this case, I do not want the main-fiber to participate in the work,
+        /*  By default, I do not want the main-fiber to participate in the work,
             so it is free to handle other things */
-        if (!main_scheduler) {
-            s_schedulers[s_current_scheduler++] = this;
+        auto participates = !main_scheduler || main_weight > 0.0;
+        if (participates) {
+            auto index = s_registered++;
+            BOOST_ASSERT(index < std::size(s_schedulers));
+            s_schedulers[index] = this;
+            m_index = index;
+            if (main_scheduler) {
+                s_main_index = index;
+                s_main_weight = std::min(main_weight, 1.0);
+            }
         }
 
+        this_thread().scheduler = this;
+
         /*  We wait for each scheduler to finish initialising, the main fiber's
             and worker's schedulers will be constructed in a non-deterministic
             fashion. (i.e, when the thread gets around to it), if we didn't wait, a
             fiber may awake on a partially constructed object. This UB and
             consequently your computer might turn into a unicorn and fly away. */
         barrier.wait();
+
+        if constexpr (Workers != dynamic_workers) {
+            BOOST_ASSERT_MSG(s_registered == Workers,
+                    "fixed worker count does not match the schedulers taking part");
+        }
     }
 
 
-    /*  Used to accept a context from another thread */
+    /*  Used to accept a context from another thread. It goes into the inbox
+        rather than the ready queue, which only the owning thread touches. The
+        receiving scheduler may be idle, so it has to be woken up to notice the
+        new fiber. */
     auto accept(context * ctx) -> void 
     {
-        auto lock = std::lock_guard<std::mutex>{ s_mutex };
-        m_local_queue.push_back(*ctx);
+        /*  Property changes are sent to the algorithm that last awakened the
+            fiber, which is still the placing scheduler */
+        properties(ctx).set_algorithm(this);
+        mark_ready(ctx);
+        /*  Counted before it can be seen, as the owning thread takes it off
+            the count as soon as it picks it, which would otherwise wrap */
+        m_gauges.ready.fetch_add(1, std::memory_order_relaxed);
+        {
+            auto lock = std::lock_guard<std::mutex>{ m_inbox_mutex };
+            m_inbox.push_back(*ctx);
+            m_inbox_pending.store(true, std::memory_order_release);
+        }
+        TLFIBER_PROBE(accept, ctx, probe_index(), probe_depth());
+        m_stats.on_accepted();
+        m_idle.notify();
     }
     
 
@@ -148,41 +411,118 @@ public:
         ready queue. */
     auto awakened(context * ctx, thread_locked_props & props) noexcept -> void
     {
-        auto lock = std::unique_lock<std::mutex>{s_mutex};
+        TLFIBER_PROBE(awakened, ctx, probe_index(), probe_depth());
+        m_stats.on_awakened();
         if (ctx->is_context( boost::fibers::type::pinned_context) ) { 
-            m_local_queue.push_back(*ctx);
+            enqueue(ctx);
         } 
         else {
             ctx->detach();
             if (props.was_previously_awakened()) {
-                m_local_queue.push_back(*ctx);
+                if constexpr (queue_has_wake<Queue>::value) {
+                    /*  Neither a yield, nor a wake up by the dispatcher for
+                        a timer or another thread. A yielding fiber is made
+                        ready by the fiber it switched to, so it is told
+                        apart by `pick_next`, which saw it go. */
+                    auto active = context::active();
+                    if (ctx == std::exchange(m_yielding, nullptr)) {
+                        enqueue(ctx);
+                        return;
+                    }
+                    if (active != ctx && !active->is_context(
+                            boost::fibers::type::dispatcher_context)) {
+                        mark_ready(ctx);
+                        m_local_queue.wake(ctx);
+                        m_gauges.ready.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                }
+                enqueue(ctx);
             } 
             else {
-                s_current_scheduler = ++s_current_scheduler % 
-                        std::size(s_schedulers);
-                lock.unlock();
                 props.set_previously_awakened();
-                auto next = s_schedulers[s_current_scheduler];
+                if (auto options = std::exchange(this_thread().options,
+                        nullptr)) {
+                    props.apply(*options);
+                }
+                /*  Not copying the pointer, which would touch the other
+                    scheduler's reference count */
+                auto next = s_schedulers[place()].get();
+                props.set_home(&next->m_gauges, next->m_index);
+                m_stats.on_placed();
                 next->accept(ctx);
             }
         }
     }
 
-    /* Returns the fiber to be resumed next */
+    /*  A property of a fiber in the ready queue has changed, which may alter
+        where it belongs in the queue. Only the owning thread may touch the
+        queue; a change made from any other thread is picked up when the
+        fiber is next queued. */
+    auto property_change(context * ctx, thread_locked_props &) noexcept -> void
+    {
+        if (this_thread().scheduler != this) {
+            return;
+        }
+        /*  The fiber may still be in the inbox */
+        drain_inbox();
+        if (ctx->ready_is_linked()) {
+            m_local_queue.requeue(ctx);
+        }
+    }
+
+    /*  Returns the fiber to be resumed next; the target of `yield_to`, if
+        there is one and it is ready, otherwise whatever the queue says. Only
+        the owning thread uses the ready queue, so no lock is taken unless
+        fibers have arrived in the inbox since last time. */
     auto pick_next() noexcept -> context *
     {
-        context * ctx = nullptr;
-        auto lock = std::unique_lock<std::mutex>{ s_mutex };
+        drain_inbox();
+
+        ++m_picks;
+        if constexpr (queue_has_wake<Queue>::value) {
+            /*  A fiber switching away that is not waiting on anything, not
+                sleeping and not finished is yielding, and is made ready
+                again as soon as the switch is done. Boost's own primitives
+                link a fiber into their wait list before it switches away; a
+                fiber parked by a primitive that does not looks the same, so
+                if the very next fiber wakes it, it is queued rather than
+                taking the slot. */
+            auto active = context::active();
+            m_yielding = active->wait_is_linked() ||
+                    active->sleep_is_linked() ||
+                    active->terminated_is_linked()
+                    ? nullptr : active;
+        }
 
-        if ( ! m_local_queue.empty() ) {
-            ctx = & m_local_queue.front();
-            m_local_queue.pop_front();
-            lock.unlock();
+        context * ctx = nullptr;
+        if (m_yield_target) {
+            ctx = m_local_queue.extract(
+                    std::exchange(m_yield_target, context::id{}));
+        }
+        if (nullptr == ctx) {
+            ctx = m_local_queue.pop();
+        }
 
+        if (nullptr != ctx) {
+            m_slice_start = utility::cycle_clock::now();
+            m_gauges.ready.fetch_sub(1, std::memory_order_relaxed);
+            m_stats.on_picked();
             if (!ctx->is_context(boost::fibers::type::pinned_context)) {
                 context::active()->attach(ctx);
+                auto & props = properties(ctx);
+                props.set_queued(false);
+                if (!props.is_registered()) {
+                    props.register_with(m_registry);
+                }
             }
         }
+        account_switch(ctx);
+        if (m_snapshot_wanted.load(std::memory_order_relaxed)) {
+            take_snapshot(ctx);
+        }
+        m_activity.beat(m_picks, ctx);
+        TLFIBER_PROBE(pick_next, ctx, probe_index(), probe_depth());
 
         return ctx;
     }
@@ -191,48 +531,675 @@ public:
     /* Do we have any fibers ready to run? */
     auto has_ready_fibers() const noexcept -> bool
     {
-        auto lock = std::lock_guard<std::mutex>{s_mutex};
-        return ! m_local_queue.empty();
+        return ! m_local_queue.empty() ||
+                m_inbox_pending.load(std::memory_order_acquire);
     }
 
 
     auto suspend_until(std::chrono::steady_clock::time_point const& time_point)
         noexcept -> void
     {
-        if ( (std::chrono::steady_clock::time_point::max)() == time_point) {
-            auto lock = std::unique_lock<std::mutex>{ s_mutex };
-            m_condition.wait( lock, [this](){ return m_flag; });
-            m_flag = false;
-        } else {
-            auto lock = std::unique_lock<std::mutex>{ s_mutex };
-            m_condition.wait_until(lock, time_point, [this](){ return m_flag; });
-            m_flag = false;
-        }
+        TLFIBER_PROBE(suspend_until, 0, probe_index(), probe_depth());
+        m_stats.on_idle();
+        m_activity.running.store(nullptr, std::memory_order_relaxed);
+        m_activity.suspended.store(true, std::memory_order_relaxed);
+        m_idle.suspend_until(time_point);
+        /*  Time spent idle is not time stalled, so the clock restarts before
+            the watchdog can see the thread as running again */
+        m_activity.last_switch.store(utility::coarse_clock::now()
+                .time_since_epoch().count(), std::memory_order_relaxed);
+        m_activity.suspended.store(false, std::memory_order_release);
     }
 
     auto notify() noexcept -> void
     {
-        auto lock = std::unique_lock<std::mutex>{ s_mutex };
-        m_flag = true;
-        lock.unlock();
-        m_condition.notify_all();
+        TLFIBER_PROBE(notify, 0, probe_index(), probe_depth());
+        m_idle.notify();
+    }
+
+
+    auto stats() const noexcept -> Stats const&
+    {
+        return m_stats;
+    }
+
+    auto queue() const noexcept -> Queue const&
+    {
+        return m_local_queue;
+    }
+
+    auto gauges() const noexcept -> shard_gauges const&
+    {
+        return m_gauges;
+    }
+
+    auto activity() const noexcept -> shard_activity const&
+    {
+        return m_activity;
+    }
+
+    /*  Position in `schedulers()`, or `no_index` for a main scheduler that
+        does not take part in the work */
+    auto index() const noexcept -> std::size_t
+    {
+        return m_index;
+    }
+
+    /*  The thread this scheduler runs on */
+    auto native_handle() const noexcept -> ::pthread_t
+    {
+        return m_thread;
+    }
+
+    static constexpr auto no_index = static_cast<std::size_t>(-1);
+
+
+    /*  Asks the scheduler to take a snapshot of its fibers the next time it
+        switches, waking it if it is idle. `snapshots_taken` goes up once it
+        has, and `last_snapshot` then returns it. */
+    auto request_snapshot() noexcept -> void
+    {
+        m_snapshot_wanted.store(true, std::memory_order_relaxed);
+        m_idle.notify();
+    }
+
+    auto snapshots_taken() const noexcept -> std::uint64_t
+    {
+        return m_snapshots_taken.load(std::memory_order_acquire);
+    }
+
+    auto last_snapshot() -> shard_snapshot
+    {
+        auto lock = std::lock_guard<std::mutex>{ m_registry.mutex };
+        return m_snapshot;
+    }
+
+
+    /*  Yields to fiber `id`, which runs next if it is ready on this thread,
+        regardless of its place in the queue. Otherwise this is a plain
+        yield. */
+    static auto yield_to(boost::fibers::fiber::id id) -> void
+    {
+        auto & state = this_thread();
+        BOOST_ASSERT_MSG(nullptr != state.scheduler,
+                "yield_to called from a thread without this scheduler");
+        state.scheduler->m_yield_target = id;
+        boost::this_fiber::yield();
+    }
+
+
+    /*  Yields if the calling fiber has had the thread for longer than the
+        pool's time slice, returning whether it did. Meant to be sprinkled
+        through long computations, so that they share the thread with the
+        other fibers pinned to it. The slice starts when the scheduler picks
+        the fiber, so work done before the first call counts against it too.
+        Only reads the cycle counter, which the first call in the process
+        measures against the clock (see `utility::cycle_clock`). */
+    static auto maybe_yield() -> bool
+    {
+        auto scheduler = this_thread().scheduler;
+        if (nullptr == scheduler) {
+            return false;
+        }
+        auto ran = utility::cycle_clock::to_duration(
+                utility::cycle_clock::now() - scheduler->m_slice_start);
+        auto slice = std::chrono::nanoseconds{
+                s_time_slice.load(std::memory_order_relaxed)};
+        if (ran < slice) {
+            return false;
+        }
+        boost::this_fiber::yield();
+        return true;
+    }
+
+    /*  How long a fiber may run before `maybe_yield` gives the thread up, for
+        every scheduler in the pool */
+    static auto set_time_slice(std::chrono::nanoseconds slice) noexcept -> void
+    {
+        s_time_slice.store(slice.count(), std::memory_order_relaxed);
+    }
+
+
+    /*  Limits every scheduler to `limit` live pinned fibers, and sets what
+        `spawn` does when a fiber would exceed it. Fibers created directly,
+        rather than through `spawn`, are still counted, but are always
+        redirected to a scheduler with room, whatever the policy, and go over
+        the limit when there is none; they are never blocked or rejected. */
+    static auto set_admission_limit(std::size_t limit,
+            overload_policy policy = overload_policy::block) noexcept -> void
+    {
+        s_overload.store(policy, std::memory_order_relaxed);
+        s_admission_limit.store(limit, std::memory_order_release);
+        /*  A higher limit, or another policy, may let blocked spawns go */
+        for (auto ii = std::size_t{0}; ii != list_size(); ++ii) {
+            s_schedulers[ii]->m_gauges.wake_blocked();
+        }
+    }
+
+    /*  Launches a fiber, subject to the admission limit. Must be called from a
+        thread running one of these schedulers. Blocking suspends the calling
+        fiber, not the thread, until a fiber on the chosen scheduler ends. */
+    template <typename Fn, typename ... Args,
+            typename = std::enable_if_t<
+                    !std::is_same_v<std::decay_t<Fn>, spawn_options>>>
+    static auto spawn(Fn && fn, Args && ... args) -> boost::fibers::fiber
+    {
+        return spawn(spawn_options{},
+                std::forward<Fn>(fn), std::forward<Args>(args)...);
+    }
+
+    /*  As above, with the fiber's scheduling properties in place before it
+        is first queued */
+    template <typename Fn, typename ... Args>
+    static auto spawn(spawn_options const& options, Fn && fn,
+            Args && ... args) -> boost::fibers::fiber
+    {
+        auto & state = this_thread();
+        BOOST_ASSERT_MSG(nullptr != state.scheduler,
+                "spawn called from a thread without this scheduler");
+        auto index = state.scheduler->reserve();
+        state.reserved = index;
+        state.options = &options;
+        try {
+            auto fiber = boost::fibers::fiber{
+                    std::forward<Fn>(fn), std::forward<Args>(args)...};
+            state.reserved = no_reservation;
+            state.options = nullptr;
+            return fiber;
+        }
+        catch (...) {
+            /*  The fiber never got as far as being placed */
+            state.options = nullptr;
+            if (state.reserved == index) {
+                state.reserved = no_reservation;
+                s_schedulers[index]->m_gauges.release();
+            }
+            throw;
+        }
+    }
+
+    /*  Launches a fiber pinned to scheduler `index` of `schedulers()`,
+        whatever the placement policy would have chosen; for work that has to
+        run where some shard's state lives. The fiber is counted as live, but
+        the admission limit does not apply, as there is nowhere else for it
+        to go. Must be called from a thread running one of these
+        schedulers. */
+    template <typename Fn, typename ... Args,
+            typename = std::enable_if_t<
+                    !std::is_same_v<std::decay_t<Fn>, spawn_options>>>
+    static auto spawn_on(std::size_t index, Fn && fn, Args && ... args)
+            -> boost::fibers::fiber
+    {
+        return spawn_on(index, spawn_options{},
+                std::forward<Fn>(fn), std::forward<Args>(args)...);
+    }
+
+    template <typename Fn, typename ... Args>
+    static auto spawn_on(std::size_t index, spawn_options const& options,
+            Fn && fn, Args && ... args) -> boost::fibers::fiber
+    {
+        auto & state = this_thread();
+        BOOST_ASSERT_MSG(nullptr != state.scheduler,
+                "spawn_on called from a thread without this scheduler");
+        BOOST_ASSERT(index < list_size());
+        s_schedulers[index]->m_gauges.live.fetch_add(1,
+                std::memory_order_relaxed);
+        state.reserved = index;
+        state.options = &options;
+        try {
+            auto fiber = boost::fibers::fiber{
+                    std::forward<Fn>(fn), std::forward<Args>(args)...};
+            state.reserved = no_reservation;
+            state.options = nullptr;
+            return fiber;
+        }
+        catch (...) {
+            state.options = nullptr;
+            if (state.reserved == index) {
+                state.reserved = no_reservation;
+                s_schedulers[index]->m_gauges.release();
+            }
+            throw;
+        }
+    }
+
+    /*  Position in `schedulers()` of the calling thread's scheduler; `no_index`
+        if it has none, or has one that does not take part in the work */
+    static auto current_index() noexcept -> std::size_t
+    {
+        auto scheduler = this_thread().scheduler;
+        return nullptr == scheduler ? no_index : scheduler->m_index;
+    }
+
+    /*  Every scheduler participating in the work, in registration order.
+        Only complete once all of the schedulers have been constructed. When
+        the main scheduler does not take part, a dynamic list ends with an
+        unused, null, entry. */
+    static auto schedulers() noexcept -> scheduler_list_t const&
+    {
+        return s_schedulers;
+    }
+
+    /*  Number of schedulers in `schedulers()` taking part in the work */
+    static auto scheduler_count() noexcept -> std::size_t
+    {
+        return list_size();
     }
 
 private:
-    static std::atomic<std::size_t> s_current_scheduler;
-    static scheduler_list_t         s_schedulers;
-    static std::mutex               s_mutex;
+    /*  A compile-time constant for a fixed list, so that `wrap_index` can
+        turn the modulo into a mask. A dynamic list may have a spare slot
+        left over for the main scheduler, so its size is however many
+        schedulers registered. */
+    static auto list_size() noexcept
+    {
+        if constexpr (Workers == dynamic_workers) {
+            return s_registered.load(std::memory_order_relaxed);
+        } else {
+            return std::integral_constant<std::size_t, Workers>{};
+        }
+    }
+
+    /*  Probe arguments; signed, so that a main scheduler's missing index
+        shows up as -1 */
+    auto probe_index() const noexcept -> std::int64_t
+    {
+        return static_cast<std::int64_t>(m_index);
+    }
+    auto probe_depth() const noexcept -> std::int64_t
+    {
+        return static_cast<std::int64_t>(
+                m_gauges.ready.load(std::memory_order_relaxed));
+    }
+
+    /*  Only ever called on the owning thread */
+    auto enqueue(context * ctx) noexcept -> void
+    {
+        mark_ready(ctx);
+        m_local_queue.push(ctx);
+        m_gauges.ready.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /*  Per fiber accounting, when the stats policy wants it. The fiber
+        switched away from is charged for the time since it was resumed, and
+        the one being resumed for the time since it was made ready. Pinned
+        contexts, the dispatcher and main fibers, are left out, as they are
+        when flagging fibers as queued for snapshots. */
+    auto mark_ready(context * ctx) noexcept -> void
+    {
+        if (ctx->is_context(boost::fibers::type::pinned_context)) {
+            return;
+        }
+        auto & props = properties(ctx);
+        props.set_queued(true);
+        if constexpr (stats_accounts_fibers<Stats>::value) {
+            props.accounting().ready_since = utility::cycle_clock::now();
+        }
+    }
+
+    auto account_switch(context * next) noexcept -> void
+    {
+        if constexpr (stats_accounts_fibers<Stats>::value) {
+            auto now = utility::cycle_clock::now();
+            if (nullptr != m_current) {
+                properties(m_current).accounting().cpu_ticks +=
+                        now - m_resumed_at;
+            }
+            m_current = nullptr;
+            if (nullptr != next &&
+                    !next->is_context(boost::fibers::type::pinned_context)) {
+                auto & accounting = properties(next).accounting();
+                ++accounting.resumes;
+                accounting.wait_ticks += now - accounting.ready_since;
+                m_current = next;
+                m_resumed_at = now;
+            }
+        }
+    }
+
+    /*  Records the state of every registered fiber. Only the owning thread
+        can tell a ready fiber from a sleeping one safely, so this is done
+        here rather than by whoever asked. */
+    auto take_snapshot(context * running) -> void
+    {
+        m_snapshot_wanted.store(false, std::memory_order_relaxed);
+        auto lock = std::lock_guard<std::mutex>{ m_registry.mutex };
+        auto snapshot = shard_snapshot{};
+        snapshot.ready = m_gauges.ready.load(std::memory_order_relaxed);
+        snapshot.live = m_gauges.live.load(std::memory_order_relaxed);
+        for (auto const& props : m_registry.fibers) {
+            auto fiber = props.context();
+            auto state = fiber_state::waiting;
+            if (fiber == running) {
+                state = fiber_state::running;
+            } else if (props.is_queued()) {
+                state = fiber_state::ready;
+            } else if (fiber->sleep_is_linked()) {
+                state = fiber_state::sleeping;
+                ++snapshot.sleeping;
+            }
+            snapshot.fibers.push_back({fiber->get_id(), props.name(), state,
+                    props.accounting()});
+            if (0 != props.accounting().resumes) {
+                snapshot.totals[props.name()].add(props.accounting());
+            }
+        }
+        for (auto const& [name, finished] : m_registry.finished) {
+            snapshot.totals[name].add(finished);
+        }
+        m_snapshot = std::move(snapshot);
+        m_snapshots_taken.fetch_add(1, std::memory_order_release);
+    }
+
+    /*  Moves everything accepted from other threads into the ready queue.
+        The whole inbox is taken in one go, and the lock is only held for the
+        swap; the queue policy then orders the batch as usual. */
+    auto drain_inbox() noexcept -> void
+    {
+        if (!m_inbox_pending.load(std::memory_order_acquire)) {
+            return;
+        }
+        auto batch = inbox_t{};
+        {
+            auto lock = std::lock_guard<std::mutex>{ m_inbox_mutex };
+            batch.swap(m_inbox);
+            m_inbox_pending.store(false, std::memory_order_relaxed);
+        }
+        while (!batch.empty()) {
+            auto ctx = &batch.front();
+            batch.pop_front();
+            m_local_queue.push(ctx);
+        }
+    }
+
+    static auto admission_limit() noexcept -> std::size_t
+    {
+        return s_admission_limit.load(std::memory_order_acquire);
+    }
 
-    local_queue_t           m_local_queue;
-    std::condition_variable m_condition;
-    bool                    m_flag;
-    bool                    m_suspend;
+    /*  Counts one more live fiber against scheduler `index`, unless it is
+        already at the limit */
+    static auto try_reserve(std::size_t index, std::size_t limit) noexcept -> bool
+    {
+        auto & live = s_schedulers[index]->m_gauges.live;
+        auto count = live.load(std::memory_order_relaxed);
+        do {
+            if (count >= limit) {
+                return false;
+            }
+        } while (!live.compare_exchange_weak(count, count + 1,
+                std::memory_order_relaxed));
+        return true;
+    }
 
+    /*  Looks for a scheduler after `index` with room, reserving a place */
+    static auto try_redirect(std::size_t index, std::size_t limit) noexcept
+            -> std::size_t
+    {
+        auto count = list_size();
+        for (auto ii = std::size_t{1}; ii != count; ++ii) {
+            auto other = (index + ii) % count;
+            if (try_reserve(other, limit)) {
+                return other;
+            }
+        }
+        return no_reservation;
+    }
+
+    /*  Suspends the calling fiber until scheduler `index` has room for
+        another fiber, or the limit or policy changes. Returns whether a
+        place was reserved. */
+    static auto wait_for_room(std::size_t index) -> bool
+    {
+        auto & gauges = s_schedulers[index]->m_gauges;
+        auto lock = std::unique_lock<std::mutex>{ gauges.blocked_mutex };
+        gauges.blocked.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto reserved = false;
+        gauges.room.wait(lock, [index, &reserved](){
+            auto limit = admission_limit();
+            if (limit != no_limit &&
+                    s_overload.load(std::memory_order_relaxed) ==
+                            overload_policy::block) {
+                reserved = try_reserve(index, limit);
+                return reserved;
+            }
+            return true;
+        });
+        gauges.blocked.fetch_sub(1, std::memory_order_relaxed);
+        return reserved;
+    }
+
+    /*  Chooses and reserves a place for a fiber about to be spawned */
+    auto reserve() -> std::size_t
+    {
+        auto index = select_target();
+        for (;;) {
+            auto limit = admission_limit();
+            if (limit == no_limit) {
+                s_schedulers[index]->m_gauges.live.fetch_add(1,
+                        std::memory_order_relaxed);
+                return index;
+            }
+            if (try_reserve(index, limit)) {
+                return index;
+            }
+            switch (s_overload.load(std::memory_order_relaxed)) {
+            case overload_policy::redirect:
+                if (auto other = try_redirect(index, limit);
+                        other != no_reservation) {
+                    return other;
+                }
+                throw admission_error{"every scheduler is at its fiber limit"};
+            case overload_policy::reject:
+                throw admission_error{"scheduler is at its fiber limit"};
+            case overload_policy::block:
+                if (wait_for_room(index)) {
+                    return index;
+                }
+                break;
+            }
+        }
+    }
+
+    /*  Scheduler a newly awakened fiber is pinned to, counted as live. A fiber
+        launched by `spawn` already has its place reserved. */
+    auto place() noexcept -> std::size_t
+    {
+        auto & state = this_thread();
+        if (state.reserved != no_reservation) {
+            auto index = state.reserved;
+            state.reserved = no_reservation;
+            return index;
+        }
+
+        /*  Whatever the overload policy, a fiber that already exists can
+            neither wait nor be turned away, so it goes wherever there is
+            room, or over the limit where it was going if there is none */
+        auto index = select_target();
+        auto limit = admission_limit();
+        if (limit != no_limit) {
+            if (try_reserve(index, limit)) {
+                return index;
+            }
+            if (auto other = try_redirect(index, limit);
+                    other != no_reservation) {
+                return other;
+            }
+        }
+        s_schedulers[index]->m_gauges.live.fetch_add(1,
+                std::memory_order_relaxed);
+        return index;
+    }
+
+    /*  Index of the scheduler a new fiber is placed on. With `n` workers,
+        the main scheduler gets `weight / (n + weight)` of the fibers and
+        each worker `1 / (n + weight)`, so it has `weight` times as many as
+        a worker. Every placement adds its share to the main scheduler's
+        credit, which takes a fiber once it has a whole one's worth; the
+        others go round the workers, the cursor stepping past the main
+        scheduler rather than its turn being handed to whoever follows it. */
+    auto select_target() noexcept -> std::size_t
+    {
+        auto count = list_size();
+        if (s_main_index == no_main_index || s_main_weight >= 1.0 ||
+                count < 2) {
+            return m_placement.next(count);
+        }
+        m_main_credit += s_main_weight / (count - 1 + s_main_weight);
+        if (m_main_credit >= 1.0) {
+            m_main_credit -= 1.0;
+            return s_main_index;
+        }
+        auto index = m_placement.next(count);
+        if (index == s_main_index) {
+            index = m_placement.next(count);
+        }
+        return index;
+    }
+
+    static constexpr auto no_main_index = static_cast<std::size_t>(-1);
+    static constexpr auto no_limit = static_cast<std::size_t>(-1);
+    static constexpr auto no_reservation = static_cast<std::size_t>(-1);
+
+    /*  The scheduler installed on this thread, and a place reserved by
+        `spawn` for the fiber it is launching, along with the properties it
+        starts with. A function local rather than a static member, as GCC
+        does not emit the thread local wrapper for a static member of an
+        explicitly instantiated template. */
+    struct thread_state
+    {
+        basic_thread_locked_scheduler * scheduler{nullptr};
+        std::size_t                     reserved{no_reservation};
+        spawn_options const *           options{nullptr};
+    };
+
+    static auto this_thread() noexcept -> thread_state &
+    {
+        thread_local thread_state state{};
+        return state;
+    }
+
+    /*  Only written before the schedulers synchronise on the barrier */
+    inline static std::size_t              s_main_index{no_main_index};
+    inline static double                   s_main_weight{0.0};
+
+    inline static std::atomic<std::size_t> s_admission_limit{no_limit};
+    inline static std::atomic<overload_policy> s_overload{
+            overload_policy::block};
+
+    inline static std::atomic<std::chrono::nanoseconds::rep> s_time_slice{
+            std::chrono::nanoseconds{std::chrono::milliseconds{1}}.count()};
+
+
+    /*  Read on every placement, written only while starting up. `alignas`
+        applies to a single declaration, so each starts a line of its own,
+        away from the statics that are written while running. */
+    alignas(utility::cache_line_size)
+    inline static std::atomic<std::size_t> s_registered{0};
+    alignas(utility::cache_line_size)
+    inline static scheduler_list_t         s_schedulers{};
+
+    /*  The members are grouped by who writes them, each group starting on a
+        cache line of its own, so that a thread placing a fiber here does not
+        take the lines the owning thread is working on away from it. */
+
+    /*  Only touched by the owning thread */
+    alignas(utility::cache_line_size)
+    Queue       m_local_queue;
+    Placement   m_placement;
+    Stats       m_stats;
+    double      m_main_credit;
+    context::id m_yield_target;
+    /*  Fiber last switched away from, if it was yielding, for queues with
+        a `wake` */
+    context *   m_yielding;
+    std::size_t m_picks;
+    /*  When the fiber running now was picked, by `utility::cycle_clock`,
+        for `maybe_yield` */
+    std::uint64_t m_slice_start;
+    /*  Fiber being charged for its time, if accounting */
+    context *   m_current;
+    std::uint64_t m_resumed_at;
+
+    /*  Written by the threads placing fibers here: fibers accepted from
+        them, guarded by `m_inbox_mutex`, and the wake up */
+    alignas(utility::cache_line_size)
+    std::mutex  m_inbox_mutex;
+    inbox_t     m_inbox;
+    std::atomic<bool> m_inbox_pending;
+    std::atomic<bool> m_snapshot_wanted;
+    Idle        m_idle;
+
+    /*  Updated by the owner, and by other threads when counting fibers in
+        or out; read from anywhere. The last snapshot is guarded by the
+        registry's mutex. */
+    alignas(utility::cache_line_size)
+    shard_gauges m_gauges;
+    shard_registry m_registry;
+    shard_snapshot m_snapshot;
+    std::atomic<std::uint64_t> m_snapshots_taken;
+
+    /*  Written by the owner on every switch, read by monitoring threads */
+    alignas(utility::cache_line_size)
+    shard_activity m_activity;
+
+    /*  Set once, while starting up */
+    alignas(utility::cache_line_size)
+    std::size_t m_index;
+    ::pthread_t m_thread;
 };
 
 
+using thread_locked_scheduler = basic_thread_locked_scheduler<>;
+
+/*  Default policies, with the number of workers fixed at compile time */
+template <std::size_t Workers>
+using fixed_thread_locked_scheduler = basic_thread_locked_scheduler<
+        local_round_robin_placement, fifo_queue, condition_idle, no_stats,
+        Workers>;
 
+/*  The default scheduler is instantiated once, in the library */
+extern template class basic_thread_locked_scheduler<>;
 
 
 
+/*  Counterparts to `boost::this_fiber` for the thread locked schedulers */
+namespace this_fiber {
+
+/*  Switches straight to fiber `id` if it is ready on the calling thread's
+    scheduler, bypassing the order of the ready queue */
+template <typename Scheduler = thread_locked_scheduler>
+inline auto yield_to(boost::fibers::fiber::id id) -> void
+{
+    Scheduler::yield_to(id);
+}
+
+/*  Yields if the calling fiber's time slice has run out */
+template <typename Scheduler = thread_locked_scheduler>
+inline auto maybe_yield() -> bool
+{
+    return Scheduler::maybe_yield();
+}
+
+/*  Calls `fn(index)` for each index in [first, last), checking the time slice
+    every `stride` iterations, so that a long loop yields when its slice runs
+    out without paying for a clock read each time round. A `stride` of 0 is
+    taken as 1. */
+template <typename Scheduler = thread_locked_scheduler, typename Index,
+          typename Fn>
+auto budgeted_for(Index first, Index last, Fn && fn, std::size_t stride = 64)
+        -> void
+{
+    stride = (std::max)(stride, std::size_t{1});
+    auto countdown = stride;
+    for (; first != last; ++first) {
+        fn(first);
+        if (0 == --countdown) {
+            countdown = stride;
+            Scheduler::maybe_yield();
+        }
+    }
+}
 
+}
@@ -0,0 +1,197 @@
+
+//      Copyright CommitThis 2020
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "thread_locked_scheduler.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <numeric>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+
+/*  Helpers for keeping state sharded across a pool of thread locked
+    schedulers, one shard per scheduler. Since a fiber never leaves the thread
+    it started on, a shard that is only ever touched by fibers pinned to its
+    scheduler needs no locks and no atomics; the work goes to the data, rather
+    than the data being shared.
+
+    The shard for a scheduler is its position in `Scheduler::schedulers()`, so
+    everything here has to be called from a fiber running on one of the pool's
+    threads, once the pool is up. */
+
+
+namespace utility {
+
+/*  Mixes the bits of a hash, so that hashes which only differ in a few bits
+    (`std::hash` of an integer is the integer) spread over both the shards and
+    the slots within a shard. The finaliser from MurmurHash3. */
+constexpr auto mix_hash(std::uint64_t hash) noexcept -> std::uint64_t
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/*  Adds to a counter that only one thread ever writes: a relaxed load and
+    store, which is a plain add rather than a locked read-modify-write, while
+    other threads can still read it */
+template <typename T>
+auto owner_add(std::atomic<T> & counter, T amount) noexcept -> void
+{
+    counter.store(counter.load(std::memory_order_relaxed) + amount,
+            std::memory_order_relaxed);
+}
+
+}
+
+
+/*  The shard owning a mixed hash. Taken from the top bits, leaving the bottom
+    ones for finding a slot within the shard. */
+template <typename Scheduler = thread_locked_scheduler>
+auto shard_for(std::uint64_t mixed) noexcept -> std::size_t
+{
+    return static_cast<std::size_t>(
+            (mixed >> 32) % Scheduler::scheduler_count());
+}
+
+
+/*  Runs `fn` on the thread of shard `index` and returns what it returns,
+    suspending the calling fiber until it has. If the caller is already on
+    that thread, `fn` is simply called. An exception thrown by `fn` is
+    rethrown in the caller. */
+template <typename Scheduler = thread_locked_scheduler, typename Fn>
+auto run_on_shard(std::size_t index, Fn && fn) -> std::invoke_result_t<Fn &>
+{
+    using result_t = std::invoke_result_t<Fn &>;
+
+    if (Scheduler::current_index() == index) {
+        return fn();
+    }
+
+    auto error = std::exception_ptr{};
+    if constexpr (std::is_void_v<result_t>) {
+        Scheduler::spawn_on(index, [&fn, &error](){
+            try {
+                fn();
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+        }).join();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    } else {
+        auto result = std::optional<result_t>{};
+        Scheduler::spawn_on(index, [&fn, &error, &result](){
+            try {
+                result.emplace(fn());
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+        }).join();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*result);
+    }
+}
+
+
+/*  Calls `fn(index)` on the thread of each shard in `indices`, all at the same
+    time, and waits for every one of them. The caller's own shard, if listed,
+    is done by the calling fiber once the others have been started. The first
+    exception thrown, if any, is rethrown once all have finished. */
+template <typename Scheduler = thread_locked_scheduler, typename Fn>
+auto run_on_shards(std::vector<std::size_t> const& indices, Fn && fn) -> void
+{
+    auto errors = std::vector<std::exception_ptr>(std::size(indices));
+    auto fibers = std::vector<boost::fibers::fiber>{};
+    fibers.reserve(std::size(indices));
+
+    auto own = Scheduler::current_index();
+    auto own_position = std::size(indices);
+    for (auto ii = std::size_t{0}; ii != std::size(indices); ++ii) {
+        if (indices[ii] == own) {
+            own_position = ii;
+            continue;
+        }
+        fibers.push_back(Scheduler::spawn_on(indices[ii],
+                [&fn, &errors, ii, index = indices[ii]](){
+            try {
+                fn(index);
+            }
+            catch (...) {
+                errors[ii] = std::current_exception();
+            }
+        }));
+    }
+    if (own_position != std::size(indices)) {
+        try {
+            fn(own);
+        }
+        catch (...) {
+            errors[own_position] = std::current_exception();
+        }
+    }
+
+    for (auto & fiber : fibers) {
+        fiber.join();
+    }
+    for (auto const& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+
+/*  `run_on_shards` for every shard in the pool */
+template <typename Scheduler = thread_locked_scheduler, typename Fn>
+auto run_on_every_shard(Fn && fn) -> void
+{
+    auto indices = std::vector<std::size_t>(Scheduler::scheduler_count());
+    std::iota(indices.begin(), indices.end(), std::size_t{0});
+    run_on_shards<Scheduler>(indices, std::forward<Fn>(fn));
+}
+
+
+/*  Groups positions in `hashes` (mixed hashes) by the shard owning them, and
+    calls `fn(position)` for each on that shard's thread, one fiber per shard
+    involved, in parallel */
+template <typename Scheduler = thread_locked_scheduler, typename Fn>
+auto run_by_shard(std::vector<std::uint64_t> const& hashes, Fn && fn) -> void
+{
+    auto positions = std::vector<std::vector<std::size_t>>(
+            Scheduler::scheduler_count());
+    for (auto ii = std::size_t{0}; ii != std::size(hashes); ++ii) {
+        positions[shard_for<Scheduler>(hashes[ii])].push_back(ii);
+    }
+
+    auto involved = std::vector<std::size_t>{};
+    for (auto ii = std::size_t{0}; ii != std::size(positions); ++ii) {
+        if (!positions[ii].empty()) {
+            involved.push_back(ii);
+        }
+    }
+    run_on_shards<Scheduler>(involved, [&positions, &fn](std::size_t index){
+        for (auto position : positions[index]) {
+            fn(position);
+        }
+    });
+}
@@ -0,0 +1,271 @@
+
+//      Copyright CommitThis 2020
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "thread_locked_scheduler.hpp"
+
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+
+/*  Watches a pool of thread locked schedulers for a worker that has stopped
+    switching fibers.
+
+    A fiber that makes a blocking call blocks its whole thread, and since the
+    other fibers pinned there cannot be moved, they stall with it. Each
+    scheduler publishes a heartbeat from `pick_next` (see `shard_activity`);
+    the watchdog thread looks at them every quarter of `threshold`, and a
+    scheduler that is not suspended but has not switched for longer than
+    `threshold` is reported, once per stall.
+
+    The report carries the fiber that was last resumed, and the stack of the
+    stuck thread, captured by sending it `signal` and calling `backtrace`
+    from the handler. The thread is running the offending fiber, so the stack
+    is the fiber's, down to the call that is blocking. Function names need
+    the executable to be linked with `-rdynamic`.
+
+    Construct it once every scheduler in the pool is up. Only one watchdog
+    should exist at a time, as the signal handler is shared.
+*/
+template <typename Scheduler = thread_locked_scheduler>
+class stall_watchdog
+{
+public:
+    struct stall
+    {
+        std::size_t                     scheduler;
+        boost::fibers::context::id      fiber;
+        std::chrono::nanoseconds        stalled_for;
+        std::vector<std::string>        stack;
+    };
+
+    using handler_t = std::function<void(stall const&)>;
+
+    explicit stall_watchdog(std::chrono::nanoseconds threshold,
+            handler_t handler = &stall_watchdog::print_stall,
+            int signal = SIGUSR2)
+        : m_threshold{threshold}
+        , m_handler{std::move(handler)}
+        , m_signal{signal}
+        , m_sent{s_taken.load(std::memory_order_relaxed)}
+        , m_stalls{0}
+        , m_reported(Scheduler::scheduler_count(), no_report)
+        , m_mutex{}
+        , m_condition{}
+        , m_stopping{false}
+        , m_thread{}
+    {
+        /*  The first call to `backtrace` loads the unwinder, which is not
+            something to be doing inside a signal handler */
+        void * frame = nullptr;
+        ::backtrace(&frame, 1);
+
+        struct sigaction action{};
+        action.sa_sigaction = &stall_watchdog::capture;
+        action.sa_flags = SA_RESTART | SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        ::sigaction(m_signal, &action, &m_previous);
+
+        m_thread = std::thread{[this](){ run(); }};
+    }
+
+    ~stall_watchdog()
+    {
+        {
+            auto lock = std::lock_guard<std::mutex>{ m_mutex };
+            m_stopping = true;
+        }
+        m_condition.notify_all();
+        m_thread.join();
+        /*  A thread that was slow to take its signal may not have taken it
+            yet, and the previous disposition is quite likely to be the
+            default, which would end the process. The handler only writes to
+            its own buffer, so if the signal has still not turned up after a
+            while, it is left installed for it. */
+        if (signals_taken(std::chrono::seconds{1})) {
+            ::sigaction(m_signal, &m_previous, nullptr);
+        }
+    }
+
+    stall_watchdog(stall_watchdog const&) = delete;
+    auto operator=(stall_watchdog const&) -> stall_watchdog & = delete;
+
+
+    /*  Stalls found so far */
+    auto stall_count() const noexcept -> std::size_t
+    {
+        return m_stalls.load(std::memory_order_relaxed);
+    }
+
+
+    /*  The default handler */
+    static auto print_stall(stall const& report) -> void
+    {
+        using namespace std::chrono;
+        utility::locked_print("scheduler ", report.scheduler,
+                " stalled for ",
+                duration_cast<milliseconds>(report.stalled_for).count(),
+                "ms running fiber ", report.fiber, "\n");
+        for (auto const& frame : report.stack) {
+            utility::locked_print("    ", frame, "\n");
+        }
+    }
+
+private:
+    auto run() -> void
+    {
+        auto lock = utility::make_unique_lock(m_mutex);
+        while (!m_condition.wait_for(lock, m_threshold / 4,
+                [this](){ return m_stopping; })) {
+            check();
+        }
+    }
+
+    auto check() -> void
+    {
+        auto now = utility::coarse_clock::now().time_since_epoch();
+        auto const& schedulers = Scheduler::schedulers();
+        for (auto ii = std::size_t{0}; ii != std::size(m_reported); ++ii) {
+            auto const& activity = schedulers[ii]->activity();
+            if (activity.suspended.load(std::memory_order_acquire)) {
+                continue;
+            }
+            auto switches = activity.switches.load(std::memory_order_relaxed);
+            auto stalled_for = now - utility::coarse_clock::duration{
+                    activity.last_switch.load(std::memory_order_relaxed)};
+            if (stalled_for < m_threshold || switches == m_reported[ii]) {
+                continue;
+            }
+            m_reported[ii] = switches;
+            m_stalls.fetch_add(1, std::memory_order_relaxed);
+
+            auto report = stall{ii, boost::fibers::context::id{
+                    activity.running.load(std::memory_order_relaxed)},
+                    stalled_for, stack_of(*schedulers[ii])};
+            m_handler(report);
+        }
+    }
+
+    /*  Interrupts the scheduler's thread to take its stack. Each request
+        carries a number of its own with the signal, and only the reply to
+        the one outstanding may write the frames; a signal that turns up
+        after its request was given up on leaves them alone. */
+    auto stack_of(Scheduler const& scheduler) -> std::vector<std::string>
+    {
+        using namespace std::chrono_literals;
+        auto request = s_requests.fetch_add(1, std::memory_order_relaxed) + 1;
+        s_request.store(request, std::memory_order_release);
+        auto value = sigval{};
+        value.sival_ptr = reinterpret_cast<void *>(
+                static_cast<std::uintptr_t>(request));
+        if (0 != ::pthread_sigqueue(scheduler.native_handle(), m_signal,
+                value)) {
+            s_request.store(no_request, std::memory_order_relaxed);
+            return {};
+        }
+        ++m_sent;
+        auto deadline = std::chrono::steady_clock::now() + 100ms;
+        while (s_answered.load(std::memory_order_acquire) != request) {
+            /*  Withdrawn, unless the reply has just claimed it, in which
+                case it is already being written and is waited for */
+            auto expected = request;
+            if (std::chrono::steady_clock::now() > deadline &&
+                    s_request.compare_exchange_strong(expected, no_request,
+                            std::memory_order_relaxed)) {
+                return {"(no stack; the thread did not take the signal)"};
+            }
+            std::this_thread::sleep_for(100us);
+        }
+
+        auto depth = s_depth.load(std::memory_order_relaxed);
+        auto stack = std::vector<std::string>{};
+        auto symbols = ::backtrace_symbols(s_frames, depth);
+        if (nullptr != symbols) {
+            /*  The first two frames are the handler and the signal
+                trampoline */
+            for (auto ii = 2; ii < depth; ++ii) {
+                stack.emplace_back(symbols[ii]);
+            }
+            std::free(symbols);
+        }
+        return stack;
+    }
+
+    /*  Whether every signal sent has been handled, waiting up to `timeout`
+        for those that have not */
+    auto signals_taken(std::chrono::nanoseconds timeout) const -> bool
+    {
+        using namespace std::chrono_literals;
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (s_taken.load(std::memory_order_acquire) != m_sent) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                return false;
+            }
+            std::this_thread::sleep_for(1ms);
+        }
+        return true;
+    }
+
+    static auto capture(int, siginfo_t * info, void *) -> void
+    {
+        if (SI_QUEUE == info->si_code) {
+            auto request = static_cast<std::uint64_t>(
+                    reinterpret_cast<std::uintptr_t>(info->si_value.sival_ptr));
+            auto expected = request;
+            if (s_request.compare_exchange_strong(expected, no_request,
+                    std::memory_order_acquire)) {
+                s_depth.store(::backtrace(s_frames, max_frames),
+                        std::memory_order_relaxed);
+                s_answered.store(request, std::memory_order_release);
+            }
+        }
+        s_taken.fetch_add(1, std::memory_order_release);
+    }
+
+    static constexpr int max_frames = 64;
+    static constexpr auto no_report = static_cast<std::uint64_t>(-1);
+    static constexpr auto no_request = std::uint64_t{0};
+
+    inline static void *            s_frames[max_frames]{};
+    inline static std::atomic<int>  s_depth{0};
+    /*  Requests made by every watchdog so far, the one waiting for a reply
+        if any, and the last one answered */
+    inline static std::atomic<std::uint64_t> s_requests{no_request};
+    inline static std::atomic<std::uint64_t> s_request{no_request};
+    inline static std::atomic<std::uint64_t> s_answered{no_request};
+    /*  Signals handled, to be matched against `m_sent` */
+    inline static std::atomic<std::uint64_t> s_taken{0};
+
+    std::chrono::nanoseconds    m_threshold;
+    handler_t                   m_handler;
+    int                         m_signal;
+    struct sigaction            m_previous{};
+    /*  Signals sent, counting on from those taken by earlier watchdogs; only
+        touched by the watchdog's thread until it is joined */
+    std::uint64_t               m_sent;
+    std::atomic<std::size_t>    m_stalls;
+    /*  Heartbeat each scheduler was last reported at */
+    std::vector<std::uint64_t>  m_reported;
+    std::mutex                  m_mutex;
+    std::condition_variable     m_condition;
+    bool                        m_stopping;
+    std::thread                 m_thread;
+};